@@ -1,16 +1,20 @@
 #include <algorithm>
 #include <array>
+#include <bit>
 #include <cassert>
 #include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <numeric>
+#include <queue>
 #include <random>
 #include <set>
 #include <sstream>
@@ -22,31 +26,268 @@
 #include <utility>
 #include <vector>
 
-template <typename T, class Compare = std::less<typename std::vector<T>::value_type>>
+#include "benchmark.h"
+#include "instrument.h"
+
+// Allocates on 64-byte boundaries, so that offsets into the storage map onto cache lines.
+template <typename T>
+struct CacheLineAllocator {
+  using value_type = T;
+  static constexpr std::align_val_t alignment{64};
+
+  CacheLineAllocator() = default;
+  template <typename U>
+  CacheLineAllocator(const CacheLineAllocator<U>&) noexcept {}
+
+  T* allocate(const size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), alignment)); }
+  void deallocate(T* p, size_t) noexcept { ::operator delete(p, alignment); }
+
+  template <typename U>
+  bool operator==(const CacheLineAllocator<U>&) const noexcept {
+    return true;
+  }
+};
+
+// d-ary heap with the largest element (by Compare) on top, like std::priority_queue. Arity 4
+// or 8 halves or thirds the height of a binary heap, and the children of a node are adjacent:
+// the storage is cache line aligned and the root sits at Arity - 1, so every group of siblings
+// starts at a multiple of Arity and stays within one cache line when Arity * sizeof(T) divides 64.
+template <typename T, class Compare = std::less<T>, size_t Arity = 4>
 class PriorityQueue {
-  using value_type = typename std::vector<T>::value_type;
-  using size_type = typename std::vector<T>::size_type;
-  using reference = typename std::vector<T>::reference;
-  using const_reference = typename std::vector<T>::const_reference;
+  static_assert(Arity >= 2 && std::has_single_bit(Arity), "Arity is a power of two");
 
  public:
-  bool empty() const noexcept { return data_.empty(); }
-  size_type size() const noexcept { return data_.size(); }
+  using value_type = T;
+  using size_type = size_t;
+  using const_reference = const T&;
+
+  PriorityQueue() = default;
+  explicit PriorityQueue(const Compare& compare) : compare_(compare) {}
 
-  void push(const value_type& value) {
-    data_.push_back(value);
-    std::push_heap(std::begin(data_), std::end(data_), compare_);
+  // Builds the heap in O(n), cheaper than n pushes.
+  template <typename InputIterator>
+  PriorityQueue(InputIterator first, InputIterator last, const Compare& compare = Compare())
+      : compare_(compare) {
+    if constexpr (pad > 0) data_.resize(pad);
+    data_.insert(data_.end(), first, last);
+    heapify();
   }
 
-  void pop() {
-    std::pop_heap(std::begin(data_), std::end(data_), compare_);
+  bool empty() const noexcept { return size() == 0; }
+  size_type size() const noexcept { return data_.size() - std::min(data_.size(), pad); }
+
+  void reserve(const size_type n) { data_.reserve(n + pad); }
+
+  void clear() noexcept { data_.erase(data_.begin() + std::min(data_.size(), pad), data_.end()); }
+
+  void push(const value_type& value) { emplace(value); }
+
+  void push(value_type&& value) { emplace(std::move(value)); }
+
+  template <typename... Args>
+  void emplace(Args&&... args) {
+    if constexpr (pad > 0) {
+      if (data_.empty()) data_.resize(pad);
+    }
+    data_.emplace_back(std::forward<Args>(args)...);
+    sift_up(size() - 1);
+  }
+
+  const_reference top() const { return at(0); }
+
+  // Removes and returns the top: the hole left by it goes down to a leaf along the larger
+  // children, and the last element is put there and sifted up (Floyd), which needs about half
+  // the comparisons of sifting the last element down from the root.
+  value_type pop() {
+    if (empty()) throw std::runtime_error("Empty queue");
+    value_type result = std::move(at(0));
+    value_type last = std::move(data_.back());
     data_.pop_back();
+    const size_t n = size();
+    if (n == 0) return result;
+
+    size_t hole = 0;
+    for (size_t child = first_child(0); child < n; child = first_child(hole)) {
+      const size_t best = largest_child(child, n);
+      at(hole) = std::move(at(best));
+      hole = best;
+    }
+    while (hole > 0) {
+      const size_t parent = (hole - 1) / Arity;
+      if (!compare_(at(parent), last)) break;
+      at(hole) = std::move(at(parent));
+      hole = parent;
+    }
+    at(hole) = std::move(last);
+    return result;
   }
 
-  const_reference top() const { return data_.front(); }
+ private:
+  // Only trivially constructible elements get the padding; they are the small ones for which
+  // sibling groups fit a cache line.
+  static constexpr size_t pad = std::is_trivially_default_constructible_v<T> ? Arity - 1 : 0;
+
+  static constexpr size_t first_child(const size_t i) noexcept { return Arity * i + 1; }
+
+  T& at(const size_t i) { return data_[i + pad]; }
+  const T& at(const size_t i) const { return data_[i + pad]; }
+
+  size_t largest_child(const size_t first, const size_t n) const {
+    size_t best = first;
+    const size_t end = std::min(first + Arity, n);
+    for (size_t c = first + 1; c < end; c++) {
+      if (compare_(at(best), at(c))) best = c;
+    }
+    return best;
+  }
+
+  void sift_up(size_t i) {
+    value_type value = std::move(at(i));
+    while (i > 0) {
+      const size_t parent = (i - 1) / Arity;
+      if (!compare_(at(parent), value)) break;
+      at(i) = std::move(at(parent));
+      i = parent;
+    }
+    at(i) = std::move(value);
+  }
+
+  void sift_down(size_t i, const size_t n) {
+    value_type value = std::move(at(i));
+    for (size_t child = first_child(i); child < n; child = first_child(i)) {
+      const size_t best = largest_child(child, n);
+      if (!compare_(value, at(best))) break;
+      at(i) = std::move(at(best));
+      i = best;
+    }
+    at(i) = std::move(value);
+  }
+
+  void heapify() {
+    const size_t n = size();
+    if (n < 2) return;
+    for (size_t i = (n - 2) / Arity + 1; i-- > 0;) sift_down(i, n);
+  }
+
+  std::vector<T, CacheLineAllocator<T>> data_;
+  Compare compare_;
+};
+
+// PriorityQueue over the keys 0..n-1, each with a priority that can change while queued: a
+// position map finds a key's node, so update() is a sift from there in O(log n) rather than an
+// erase and insert into a tree.
+template <typename Priority, class Compare = std::less<Priority>, size_t Arity = 4>
+class IndexedPriorityQueue {
+  static_assert(Arity >= 2 && std::has_single_bit(Arity), "Arity is a power of two");
+
+ public:
+  using key_type = size_t;
+
+  explicit IndexedPriorityQueue(const size_t keys, const Compare& compare = Compare())
+      : position_(keys, absent), compare_(compare) {}
+
+  bool empty() const noexcept { return heap_.empty(); }
+  size_t size() const noexcept { return heap_.size(); }
+  size_t capacity() const noexcept { return position_.size(); }
+
+  bool contains(const key_type key) const { return position_.at(key) != absent; }
+
+  const Priority& priority(const key_type key) const {
+    if (!contains(key)) throw std::out_of_range("Key not queued");
+    return heap_[position_[key]].priority;
+  }
+
+  void push(const key_type key, Priority priority) {
+    if (contains(key)) throw std::invalid_argument("Key already queued");
+    heap_.push_back({std::move(priority), key});
+    position_[key] = heap_.size() - 1;
+    sift_up(heap_.size() - 1);
+  }
+
+  // Moves key towards the top; the new priority must not rank below the old one.
+  void decrease_key(const key_type key, Priority priority) {
+    if (compare_(priority, this->priority(key)))
+      throw std::invalid_argument("decrease_key would lower the priority");
+    heap_[position_[key]].priority = std::move(priority);
+    sift_up(position_[key]);
+  }
+
+  // Sets the priority of key, queueing it if needed.
+  void update(const key_type key, Priority priority) {
+    if (!contains(key)) {
+      push(key, std::move(priority));
+      return;
+    }
+    const size_t i = position_[key];
+    const bool up = compare_(heap_[i].priority, priority);
+    heap_[i].priority = std::move(priority);
+    if (up) {
+      sift_up(i);
+    } else {
+      sift_down(i);
+    }
+  }
+
+  std::pair<key_type, const Priority&> top() const {
+    return {heap_.front().key, heap_.front().priority};
+  }
+
+  std::pair<key_type, Priority> pop() {
+    if (empty()) throw std::runtime_error("Empty queue");
+    node result = std::move(heap_.front());
+    position_[result.key] = absent;
+    if (heap_.size() > 1) {
+      heap_.front() = std::move(heap_.back());
+      heap_.pop_back();
+      position_[heap_.front().key] = 0;
+      sift_down(0);
+    } else {
+      heap_.pop_back();
+    }
+    return {result.key, std::move(result.priority)};
+  }
 
  private:
-  std::vector<T> data_;
+  static constexpr size_t absent = static_cast<size_t>(-1);
+
+  struct node {
+    Priority priority;
+    key_type key;
+  };
+
+  void place(const size_t i, node&& n) {
+    position_[n.key] = i;
+    heap_[i] = std::move(n);
+  }
+
+  void sift_up(size_t i) {
+    node n = std::move(heap_[i]);
+    while (i > 0) {
+      const size_t parent = (i - 1) / Arity;
+      if (!compare_(heap_[parent].priority, n.priority)) break;
+      place(i, std::move(heap_[parent]));
+      i = parent;
+    }
+    place(i, std::move(n));
+  }
+
+  void sift_down(size_t i) {
+    node n = std::move(heap_[i]);
+    const size_t size = heap_.size();
+    for (size_t child = Arity * i + 1; child < size; child = Arity * i + 1) {
+      size_t best = child;
+      for (size_t c = child + 1; c < std::min(child + Arity, size); c++) {
+        if (compare_(heap_[best].priority, heap_[c].priority)) best = c;
+      }
+      if (!compare_(n.priority, heap_[best].priority)) break;
+      place(i, std::move(heap_[best]));
+      i = best;
+    }
+    place(i, std::move(n));
+  }
+
+  std::vector<node> heap_;
+  std::vector<size_t> position_;
   Compare compare_;
 };
 
@@ -58,11 +299,103 @@ void test_priority_queue() {
 
   assert(!q.empty());
   assert(q.size() == 7);
+  // the root is preceded by Arity - 1 slots of padding from the aligned start of the storage
+  assert(reinterpret_cast<uintptr_t>(&q.top() - 3) % 64 == 0);
 
   while (!q.empty()) {
-    std::cout << q.top() << std::endl;
-    q.pop();
+    std::cout << q.pop() << std::endl;
+  }
+
+  std::mt19937 mt(42);
+  std::vector<int> values(1 << 20);
+  for (auto& v : values) v = static_cast<int>(mt());
+  auto sorted = values;
+  std::sort(sorted.begin(), sorted.end(), std::greater<>{});
+
+  auto check = [&](auto queue) {
+    for (const int v : sorted) assert(queue.pop() == v);
+    assert(queue.empty());
+  };
+  check(PriorityQueue<int, std::less<int>, 2>(values.begin(), values.end()));
+  check(PriorityQueue<int, std::less<int>, 8>(values.begin(), values.end()));
+
+  struct by_pointee {
+    bool operator()(const std::unique_ptr<int>& a, const std::unique_ptr<int>& b) const {
+      return *a > *b;
+    }
+  };
+  PriorityQueue<std::unique_ptr<int>, by_pointee> owners;
+  for (int i : {3, 1, 2}) owners.emplace(std::make_unique<int>(i));
+  assert(*owners.pop() == 1 && *owners.pop() == 2 && *owners.pop() == 3);
+
+  auto push_pop = [&values](auto queue) {
+    return [queue, &values]() mutable {
+      for (const int v : values) queue.push(v);
+      while (!queue.empty()) {
+        do_not_optimize(queue.top());
+        queue.pop();
+      }
+    };
+  };
+  std::cout << benchmark("std::priority_queue push/pop", push_pop(std::priority_queue<int>()),
+                         {.samples = 5})
+            << "\n"
+            << benchmark("PriorityQueue<2> push/pop",
+                         push_pop(PriorityQueue<int, std::less<int>, 2>()), {.samples = 5})
+            << "\n"
+            << benchmark("PriorityQueue<4> push/pop", push_pop(PriorityQueue<int>()),
+                         {.samples = 5})
+            << "\n"
+            << benchmark("PriorityQueue<8> push/pop",
+                         push_pop(PriorityQueue<int, std::less<int>, 8>()), {.samples = 5})
+            << "\n"
+            << benchmark("std::priority_queue from range", [&values]() {
+                 std::priority_queue<int> q(values.begin(), values.end());
+                 do_not_optimize(q.top());
+               }, {.samples = 5})
+            << "\n"
+            << benchmark("PriorityQueue<4> from range", [&values]() {
+                 PriorityQueue<int> q(values.begin(), values.end());
+                 do_not_optimize(q.top());
+               }, {.samples = 5})
+            << std::endl;
+}
+
+void test_indexed_priority_queue() {
+  IndexedPriorityQueue<double, std::greater<>> q(8);
+  for (size_t k : {0, 3, 5, 7}) q.push(k, 10.0 * static_cast<double>(k));
+  q.decrease_key(7, 1.0);
+  q.update(0, 100.0);
+  q.update(2, 4.0);
+  assert(q.contains(5) && !q.contains(1));
+  assert(q.priority(3) == 30.0);
+  std::vector<size_t> order;
+  while (!q.empty()) order.push_back(q.pop().first);
+  assert((order == std::vector<size_t>{7, 2, 3, 5, 0}));
+
+  // Random priority changes, as Dijkstra makes them, against the std::set a tree-based queue
+  // needs for the same: a sorted set of (priority, key) pairs with erase and insert.
+  constexpr size_t keys = 1 << 16;
+  std::mt19937 mt(7);
+  std::vector<std::pair<size_t, double>> updates(1 << 20);
+  for (auto& [k, p] : updates) {
+    k = mt() % keys;
+    p = std::uniform_real_distribution<>(0, 1)(mt);
   }
+  std::cout << benchmark("std::set erase/insert", [&updates]() {
+    std::set<std::pair<double, size_t>> s;
+    std::vector<double> current(keys, -1);
+    for (auto [k, p] : updates) {
+      if (current[k] >= 0) s.erase({current[k], k});
+      current[k] = p;
+      s.insert({p, k});
+    }
+    while (!s.empty()) s.erase(s.begin());
+  }, {.samples = 5}) << "\n" << benchmark("IndexedPriorityQueue update", [&updates]() {
+    IndexedPriorityQueue<double, std::greater<>> q(keys);
+    for (auto [k, p] : updates) q.update(k, p);
+    while (!q.empty()) q.pop();
+  }, {.samples = 5}) << std::endl;
 }
 
 template <typename T>
@@ -201,7 +534,7 @@ class DoubleBuffer {
   size_t size() const noexcept { return rdbuf_.size(); }
 
   void write(const T* const ptr, const size_t size) {
-    std::unique_lock<std::mutex> lock(mt_);
+    std::unique_lock<InstrumentedMutex<>> lock(mt_);
     auto length = std::min(size, wrbuf_.size());
     std::copy(ptr, ptr + length, std::begin(wrbuf_));
     wrbuf_.swap(rdbuf_);
@@ -209,22 +542,22 @@ class DoubleBuffer {
 
   template <class Output>
   void read(Output it) const {
-    std::unique_lock<std::mutex> lock(mt_);
+    std::unique_lock<InstrumentedMutex<>> lock(mt_);
     std::copy(std::cbegin(rdbuf_), std::cend(rdbuf_), it);
   }
 
   pointer data() const {
-    std::unique_lock<std::mutex> lock(mt_);
+    std::unique_lock<InstrumentedMutex<>> lock(mt_);
     return rdbuf_.data();
   }
 
   reference operator[](const size_t pos) {
-    std::unique_lock<std::mutex> lock(mt_);
+    std::unique_lock<InstrumentedMutex<>> lock(mt_);
     return rdbuf_[pos];
   }
 
   const_reference operator[](const size_t pos) const {
-    std::unique_lock<std::mutex> lock(mt_);
+    std::unique_lock<InstrumentedMutex<>> lock(mt_);
     return rdbuf_[pos];
   }
 
@@ -236,7 +569,7 @@ class DoubleBuffer {
  private:
   std::vector<T> rdbuf_;
   std::vector<T> wrbuf_;
-  mutable std::mutex mt_;
+  mutable InstrumentedMutex<> mt_{"double_buffer"};
 };
 
 template <typename T>
@@ -571,23 +904,24 @@ void shortest_path(const Graph<Vertex, Weight>& graph, const Vertex source,
   min_distance[source] = 0;
 
   previous.clear();
-  std::set<std::pair<Weight, Vertex>> vertex_queue;
-  vertex_queue.insert(std::make_pair(min_distance[source], source));
+  // vertices() is sorted, so a vertex's index is found by binary search
+  auto index_of = [&vertices](const Vertex& v) {
+    return static_cast<size_t>(std::lower_bound(vertices.begin(), vertices.end(), v) -
+                               vertices.begin());
+  };
+  IndexedPriorityQueue<Weight, std::greater<Weight>> vertex_queue(vertices.size());
+  vertex_queue.push(index_of(source), min_distance[source]);
   while (!vertex_queue.empty()) {
-    auto dist = vertex_queue.begin()->first;
-    auto u = vertex_queue.begin()->second;
-
-    vertex_queue.erase(std::begin(vertex_queue));
+    const auto [ui, dist] = vertex_queue.pop();
+    const auto& u = vertices[ui];
 
     const auto& neighbors = graph.neighbors(u);
     for (const auto& [v, w] : neighbors) {
       auto dist_via_u = dist + w;
       if (dist_via_u < min_distance[v]) {
-        vertex_queue.erase(std::make_pair(min_distance[v], v));
-
         min_distance[v] = dist_via_u;
         previous[v] = u;
-        vertex_queue.insert(std::make_pair(min_distance[v], v));
+        vertex_queue.update(index_of(v), dist_via_u);
       }
     }
   }
@@ -851,4 +1185,4 @@ void test_universe() {
   u.run(Universe::Seed::Random, 100, 100ms);
 }
 
-int main() { test_universe(); }
+int main() { test_indexed_priority_queue(); }
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+template <typename Time = std::chrono::microseconds,
+          typename Clock = std::chrono::high_resolution_clock>
+struct perf_timer {
+  template <typename F, typename... Args>
+  static Time duration(F&& f, Args&&... args) {
+    auto start = Clock::now();
+    std::invoke(std::forward<F>(f), std::forward<Args>(args)...);
+    auto end = Clock::now();
+    return std::chrono::duration_cast<Time>(end - start);
+  }
+};
+
+// Keeps the compiler from discarding a value or the stores that produced it.
+template <typename T>
+inline void do_not_optimize(T const& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void clobber_memory() { asm volatile("" : : : "memory"); }
+
+// Nanoseconds from the invariant TSC when there is one, calibrated once against
+// CLOCK_MONOTONIC_RAW, and from CLOCK_MONOTONIC_RAW itself otherwise.
+class raw_clock {
+ public:
+  static uint64_t now_ns() {
+    static const double ns_per_tick = calibrate();
+#if defined(__x86_64__) || defined(__i386__)
+    if (ns_per_tick > 0) return static_cast<uint64_t>(__rdtsc() * ns_per_tick);
+#endif
+    return monotonic_raw_ns();
+  }
+
+ private:
+  static uint64_t monotonic_raw_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+  }
+
+  static double calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) return 0;
+    auto t0 = monotonic_raw_ns();
+    auto c0 = __rdtsc();
+    while (monotonic_raw_ns() - t0 < 20'000'000) {
+    }
+    auto t1 = monotonic_raw_ns();
+    auto c1 = __rdtsc();
+    return static_cast<double>(t1 - t0) / static_cast<double>(c1 - c0);
+#else
+    return 0;
+#endif
+  }
+};
+
+struct perf_counters {
+  uint64_t cycles = 0;
+  uint64_t instructions = 0;
+  uint64_t cache_misses = 0;
+  uint64_t branch_misses = 0;
+};
+
+// Hardware counters for the calling thread through perf_event_open. They are unavailable (and
+// every call is a no-op) when the kernel or the container does not allow access.
+class PerfCounterGroup {
+ public:
+  PerfCounterGroup() {
+    constexpr std::array<uint64_t, 4> events = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES};
+    for (size_t i = 0; i < events.size(); i++) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = events[i];
+      attr.disabled = i == 0;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = PERF_FORMAT_GROUP;
+      fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, fds_[0], 0));
+      if (fds_[i] < 0) {
+        close_all();
+        return;
+      }
+    }
+  }
+
+  PerfCounterGroup(const PerfCounterGroup&) = delete;
+  PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+  ~PerfCounterGroup() { close_all(); }
+
+  bool available() const noexcept { return fds_[0] >= 0; }
+
+  void start() {
+    if (!available()) return;
+    ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+
+  perf_counters stop() {
+    if (!available()) return {};
+    ioctl(fds_[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    struct {
+      uint64_t nr;
+      uint64_t values[4];
+    } data{};
+    if (::read(fds_[0], &data, sizeof(data)) < 0 || data.nr != 4) return {};
+    return {data.values[0], data.values[1], data.values[2], data.values[3]};
+  }
+
+ private:
+  void close_all() {
+    for (auto& fd : fds_) {
+      if (fd >= 0) ::close(fd);
+      fd = -1;
+    }
+  }
+
+  std::array<int, 4> fds_ = {-1, -1, -1, -1};
+};
+
+struct benchmark_options {
+  int samples = 31;
+  std::chrono::nanoseconds min_sample_time = std::chrono::milliseconds(2);
+  std::chrono::nanoseconds warmup = std::chrono::milliseconds(50);
+  bool counters = false;
+};
+
+struct benchmark_result {
+  std::string name;
+  uint64_t iterations;  // per sample
+  double median_ns;     // all times are per iteration
+  double p99_ns;
+  double mad_ns;
+  double mean_ns;
+  double min_ns;
+  std::optional<perf_counters> counters;  // per iteration, summed over all samples
+};
+
+inline std::ostream& operator<<(std::ostream& os, const benchmark_result& r) {
+  os << std::left << std::setw(32) << r.name << std::right << std::fixed << std::setprecision(1)
+     << " median " << std::setw(10) << r.median_ns << " ns"
+     << "  p99 " << std::setw(10) << r.p99_ns << " ns"
+     << "  mad " << std::setw(8) << r.mad_ns << " ns"
+     << "  x" << r.iterations;
+  if (r.counters) {
+    os << "  cycles " << r.counters->cycles << "  instr " << r.counters->instructions
+       << "  cache-miss " << r.counters->cache_misses << "  br-miss "
+       << r.counters->branch_misses;
+  }
+  return os;
+}
+
+// Runs f repeatedly: first for the warm-up time, then in samples whose iteration count is
+// chosen so that each sample lasts at least min_sample_time. f may take the iteration count
+// (and loop itself) or nothing.
+template <typename F>
+benchmark_result benchmark(std::string name, F&& f, const benchmark_options& options = {}) {
+  auto run = [&f](const uint64_t n) {
+    if constexpr (std::is_invocable_v<F&, uint64_t>) {
+      f(n);
+    } else {
+      for (uint64_t i = 0; i < n; i++) {
+        f();
+        clobber_memory();
+      }
+    }
+  };
+
+  const uint64_t min_sample_ns = options.min_sample_time.count();
+  uint64_t iterations = 1;
+  auto warmup_end = raw_clock::now_ns() + options.warmup.count();
+  for (;;) {
+    auto start = raw_clock::now_ns();
+    run(iterations);
+    auto elapsed = raw_clock::now_ns() - start;
+    if (elapsed >= min_sample_ns && start >= warmup_end) break;
+    if (elapsed < min_sample_ns) {
+      auto scale = elapsed > 0 ? 1.4 * min_sample_ns / elapsed : 10.0;
+      iterations = std::max<uint64_t>(iterations + 1, iterations * std::min(scale, 10.0));
+    }
+  }
+
+  std::optional<PerfCounterGroup> group;
+  if (options.counters) group.emplace();
+  perf_counters total;
+
+  std::vector<double> samples(std::max(1, options.samples));
+  for (auto& sample : samples) {
+    if (group) group->start();
+    auto start = raw_clock::now_ns();
+    run(iterations);
+    auto elapsed = raw_clock::now_ns() - start;
+    if (group) {
+      auto c = group->stop();
+      total.cycles += c.cycles;
+      total.instructions += c.instructions;
+      total.cache_misses += c.cache_misses;
+      total.branch_misses += c.branch_misses;
+    }
+    sample = static_cast<double>(elapsed) / iterations;
+  }
+
+  auto percentile = [](std::vector<double> v, const double q) {
+    auto k = static_cast<size_t>(std::ceil(q * v.size())) - 1;
+    std::nth_element(v.begin(), v.begin() + k, v.end());
+    return v[k];
+  };
+
+  benchmark_result result;
+  result.name = std::move(name);
+  result.iterations = iterations;
+  result.median_ns = percentile(samples, 0.5);
+  result.p99_ns = percentile(samples, 0.99);
+  result.min_ns = *std::min_element(samples.begin(), samples.end());
+  double sum = 0;
+  for (auto s : samples) sum += s;
+  result.mean_ns = sum / samples.size();
+  std::vector<double> deviations;
+  for (auto s : samples) deviations.push_back(std::abs(s - result.median_ns));
+  result.mad_ns = percentile(deviations, 0.5);
+  if (group && group->available()) {
+    const double n = static_cast<double>(iterations) * samples.size();
+    result.counters = perf_counters{
+        static_cast<uint64_t>(total.cycles / n), static_cast<uint64_t>(total.instructions / n),
+        static_cast<uint64_t>(total.cache_misses / n),
+        static_cast<uint64_t>(total.branch_misses / n)};
+  }
+  return result;
+}
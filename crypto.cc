@@ -1,13 +1,33 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <exception>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+#include <semaphore>
+#include <set>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#include "crc.h"
 #include "cryptlib.h"
 #include "default.h"
 #include "files.h"
 #include "filters.h"
+#include "fs_walk.h"
 #include "hex.h"
 #include "osrng.h"
 #include "queue.h"
@@ -15,6 +35,7 @@
 #include "sha.h"
 #define CRYPTOPP_ENABLE_NAMESPACE_WEAK 1
 #include "md5.h"
+#include "json.hpp"
 
 std::string caesar_encrypt(std::string_view text, int shift) {
   std::string result = "";
@@ -255,6 +276,213 @@ void test_calc_hash() {
   }
 }
 
+template <class Hash>
+std::string calc_hash(const CryptoPP::byte* data, const size_t size) {
+  std::string digest;
+  Hash hash;
+
+  CryptoPP::ArraySource source(
+      data, size, true,
+      new CryptoPP::HashFilter(hash, new CryptoPP::HexEncoder(new CryptoPP::StringSink(digest))));
+
+  return digest;
+}
+
+struct dedup_options {
+  unsigned threads = std::thread::hardware_concurrency();
+  unsigned io_concurrency = 4;  // files read at the same time
+  uint64_t min_size = 1;  // empty files are skipped whatever it is
+};
+
+struct duplicate_group {
+  uint64_t size;
+  std::string hash;
+  std::vector<std::string> files;
+};
+
+void to_json(nlohmann::json& j, const duplicate_group& g) {
+  j = nlohmann::json{{"size", g.size}, {"hash", g.hash}, {"files", g.files}};
+}
+
+template <typename F>
+void parallel_for(const size_t count, const unsigned num_thread, F&& f) {
+  std::atomic<size_t> next{0};
+  std::mutex error_mt;
+  std::exception_ptr error;
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < count;) {
+      try {
+        f(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mt);
+        if (!error) error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < std::max(1u, num_thread); i++) threads.emplace_back(worker);
+  worker();
+  for (auto& t : threads) t.join();
+  if (error) std::rethrow_exception(error);
+}
+
+// Finds files with identical content in three stages, each only looking at the candidates the
+// previous one could not tell apart: equal size, then a CRC32 of the first and last 4 KB, then
+// a full Hash of the memory mapped file. Hard links to one inode are reported once.
+template <class Hash = CryptoPP::SHA256>
+std::vector<duplicate_group> find_duplicates(const std::filesystem::path& root,
+                                             const dedup_options& options = {}) {
+  struct candidate {
+    std::string path;
+    uint64_t size;
+    std::string key;
+  };
+
+  std::mutex mt;
+  std::vector<candidate> candidates;
+  std::set<std::pair<dev_t, ino_t>> inodes;
+  parallel_walk(
+      root,
+      [&](const std::string& dir, auto& spawn) {
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return;
+        std::vector<std::tuple<std::string, uint64_t, dev_t, ino_t>> files;
+        try {
+          read_directory(fd, [&](std::string_view name, unsigned char type, ino_t) {
+            if (type == DT_DIR) {
+              spawn(join_path(dir, name));
+              return;
+            }
+            if (type != DT_REG && type != DT_UNKNOWN) return;
+            struct stat st;
+            if (fstatat(fd, std::string(name).c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+            if (S_ISDIR(st.st_mode))
+              spawn(join_path(dir, name));
+            else if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+                     static_cast<uint64_t>(st.st_size) >= options.min_size)
+              files.emplace_back(join_path(dir, name), st.st_size, st.st_dev, st.st_ino);
+          });
+        } catch (...) {
+        }
+        ::close(fd);
+
+        std::lock_guard<std::mutex> lock(mt);
+        for (auto& [path, size, dev, ino] : files) {
+          if (inodes.emplace(dev, ino).second) candidates.push_back({std::move(path), size, ""});
+        }
+      },
+      options.threads);
+
+  // keeps the candidates that share (size, key) with at least one other candidate
+  auto regroup = [](std::vector<candidate>& cs) {
+    std::sort(cs.begin(), cs.end(), [](const candidate& a, const candidate& b) {
+      return std::tie(a.size, a.key) < std::tie(b.size, b.key);
+    });
+    std::vector<candidate> kept;
+    for (size_t i = 0, j; i < cs.size(); i = j) {
+      for (j = i + 1; j < cs.size() && cs[j].size == cs[i].size && cs[j].key == cs[i].key; j++) {
+      }
+      if (j - i > 1) std::move(cs.begin() + i, cs.begin() + j, std::back_inserter(kept));
+    }
+    cs = std::move(kept);
+  };
+
+  std::counting_semaphore<1024> io(std::clamp(options.io_concurrency, 1u, 1024u));
+  auto rekey = [&](std::vector<candidate>& cs, auto&& make_key) {
+    parallel_for(cs.size(), options.threads, [&](const size_t i) {
+      // the semaphore bounds open descriptors as well as reads
+      io.acquire();
+      int fd = ::open(cs[i].path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        io.release();
+        cs[i].path.clear();  // unreadable files drop out of every group
+        return;
+      }
+      try {
+        cs[i].key = make_key(fd, cs[i].size);
+      } catch (...) {
+        cs[i].path.clear();
+      }
+      ::close(fd);
+      io.release();
+    });
+    std::erase_if(cs, [](const candidate& c) { return c.path.empty(); });
+  };
+
+  regroup(candidates);
+
+  rekey(candidates, [](const int fd, const uint64_t size) {
+    constexpr size_t edge = 4096;
+    std::vector<CryptoPP::byte> buf(std::min<uint64_t>(size, 2 * edge));
+    size_t head = std::min<uint64_t>(size, edge);
+    if (::pread(fd, buf.data(), head, 0) != static_cast<ssize_t>(head))
+      throw std::runtime_error("Cannot read file");
+    size_t tail = buf.size() - head;
+    if (tail > 0 && ::pread(fd, buf.data() + head, tail, size - tail) != static_cast<ssize_t>(tail))
+      throw std::runtime_error("Cannot read file");
+    return calc_hash<CryptoPP::CRC32>(buf.data(), buf.size());
+  });
+  regroup(candidates);
+
+  rekey(candidates, [](const int fd, const uint64_t size) {
+    void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) throw std::runtime_error("Cannot map file");
+    madvise(p, size, MADV_SEQUENTIAL);
+    std::string digest;
+    try {
+      digest = calc_hash<Hash>(static_cast<const CryptoPP::byte*>(p), size);
+    } catch (...) {
+      munmap(p, size);
+      throw;
+    }
+    munmap(p, size);
+    return digest;
+  });
+  regroup(candidates);
+
+  std::vector<duplicate_group> groups;
+  for (auto& c : candidates) {
+    if (groups.empty() || groups.back().size != c.size || groups.back().hash != c.key)
+      groups.push_back({c.size, c.key, {}});
+    groups.back().files.push_back(std::move(c.path));
+  }
+  for (auto& g : groups) std::sort(g.files.begin(), g.files.end());
+  return groups;
+}
+
+void test_find_duplicates() {
+  auto root = std::filesystem::temp_directory_path() / "dedup_test";
+  std::filesystem::remove_all(root);
+  std::filesystem::create_directories(root / "a" / "b");
+
+  auto write = [](const std::filesystem::path& path, const std::string& content) {
+    std::ofstream(path, std::ios::binary) << content;
+  };
+  std::string big(20000, 'x');
+  write(root / "one.txt", "same content");
+  write(root / "a" / "two.txt", "same content");
+  write(root / "a" / "b" / "three.txt", "same content");
+  write(root / "other.txt", "same length!");
+  write(root / "big1.bin", big);
+  write(root / "a" / "big2.bin", big);
+  big[10000] = 'y';  // same head, tail and size, different middle
+  write(root / "a" / "b" / "big3.bin", big);
+  std::filesystem::create_hard_link(root / "one.txt", root / "a" / "link.txt");
+
+  write(root / "empty1", "");
+  write(root / "a" / "empty2", "");
+
+  auto groups = find_duplicates(root, {.io_concurrency = 2});
+  assert(groups.size() == 2);
+  assert(groups[0].size == 12 && groups[0].files.size() == 3);
+  assert(groups[1].size == 20000 && groups[1].files.size() == 2);
+  assert(find_duplicates(root, {.min_size = 0}).size() == 2);
+
+  std::cout << nlohmann::json(groups).dump(2) << std::endl;
+  std::filesystem::remove_all(root);
+}
+
 void encrypt_file(const std::filesystem::path& source_file, const std::filesystem::path& dest_file,
                   const std::string& password) {
   CryptoPP::FileSource source(
@@ -386,4 +614,5 @@ int main() {
   // test_calc_hash();
   // test_crypt_file();
   test_sign_file();
+  test_find_duplicates();
 }
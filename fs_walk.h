@@ -0,0 +1,113 @@
+#pragma once
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+template <typename F>
+void parallel_walk(const std::filesystem::path &root, F &&process,
+                   const unsigned num_thread = std::thread::hardware_concurrency()) {
+  struct work_queue {
+    std::mutex mt;
+    std::deque<std::string> dirs;
+  };
+
+  const unsigned n = std::max(1u, num_thread);
+  std::vector<work_queue> queues(n);
+  std::atomic<size_t> pending{1};
+  // bumped whenever there is new work or the walk is done; idle workers wait on it
+  std::atomic<uint64_t> signal{0};
+  std::mutex error_mt;
+  std::exception_ptr error;
+  queues[0].dirs.push_back(root.string());
+
+  auto worker = [&](const unsigned id) {
+    auto spawn = [&](std::string dir) {
+      pending++;
+      {
+        std::lock_guard<std::mutex> lock(queues[id].mt);
+        queues[id].dirs.push_back(std::move(dir));
+      }
+      signal.fetch_add(1, std::memory_order_release);
+      signal.notify_one();
+    };
+
+    while (pending > 0) {
+      // read before looking, so that work queued after the look changes it and ends the wait
+      const auto seen = signal.load(std::memory_order_acquire);
+      std::optional<std::string> dir;
+      for (unsigned k = 0; k < n && !dir; k++) {
+        // own queue is used as a stack (depth first), others are stolen from the front
+        auto &q = queues[(id + k) % n];
+        std::lock_guard<std::mutex> lock(q.mt);
+        if (q.dirs.empty()) continue;
+        if (k == 0) {
+          dir = std::move(q.dirs.back());
+          q.dirs.pop_back();
+        } else {
+          dir = std::move(q.dirs.front());
+          q.dirs.pop_front();
+        }
+      }
+      if (!dir) {
+        if (pending > 0) signal.wait(seen, std::memory_order_acquire);
+        continue;
+      }
+
+      try {
+        process(*dir, spawn);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mt);
+        if (!error) error = std::current_exception();
+      }
+      if (--pending == 0) {
+        signal.fetch_add(1, std::memory_order_release);
+        signal.notify_all();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < n; i++) threads.emplace_back(worker, i);
+  worker(0);
+  for (auto &t : threads) t.join();
+  if (error) std::rethrow_exception(error);
+}
+
+template <typename F>
+void read_directory(const int fd, F &&on_entry) {
+  alignas(struct dirent64) char buf[64 * 1024];
+  for (;;) {
+    auto n = getdents64(fd, buf, sizeof(buf));
+    if (n < 0) throw std::runtime_error("Cannot read directory");
+    if (n == 0) return;
+    for (ssize_t pos = 0; pos < n;) {
+      auto *d = reinterpret_cast<struct dirent64 *>(buf + pos);
+      pos += d->d_reclen;
+      if (d->d_name[0] == '.' &&
+          (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+        continue;
+      on_entry(std::string_view(d->d_name), d->d_type, d->d_ino);
+    }
+  }
+}
+
+inline std::string join_path(const std::string &dir, const std::string_view name) {
+  std::string path;
+  path.reserve(dir.size() + name.size() + 1);
+  path += dir;
+  if (path.empty() || path.back() != '/') path += '/';
+  path += name;
+  return path;
+}
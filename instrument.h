@@ -0,0 +1,443 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "benchmark.h"
+
+// Contention and scheduling metrics. They are recorded only in builds with
+// -DENABLE_INSTRUMENTATION=1; otherwise the hooks compile to nothing and InstrumentedMutex is
+// the bare mutex.
+#ifndef ENABLE_INSTRUMENTATION
+#define ENABLE_INSTRUMENTATION 0
+#endif
+constexpr bool instrumentation = ENABLE_INSTRUMENTATION;
+
+// Each thread updates metrics in a shard of its own, with a plain load and store instead of a
+// locked add, and without bouncing a cache line between cores. A shard returns to the pool when
+// its thread exits; threads beyond metric_shards share one more shard with atomic adds.
+constexpr size_t metric_shards = 64;
+
+class metric_shard {
+ public:
+  static size_t index() {
+    thread_local const metric_shard shard;
+    return shard.index_;
+  }
+
+  static bool exclusive(const size_t index) noexcept { return index < metric_shards; }
+
+  static void add(std::atomic<uint64_t>& value, const uint64_t n, const size_t index) noexcept {
+    if (exclusive(index)) {
+      value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    } else {
+      value.fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  metric_shard() {
+    std::lock_guard<std::mutex> lock(mt());
+    if (!free().empty()) {
+      index_ = free().back();
+      free().pop_back();
+    } else {
+      index_ = std::min(next()++, metric_shards);
+    }
+  }
+
+  ~metric_shard() {
+    if (!exclusive(index_)) return;
+    std::lock_guard<std::mutex> lock(mt());
+    free().push_back(index_);
+  }
+
+  static std::mutex& mt() {
+    static std::mutex m;
+    return m;
+  }
+  static std::vector<size_t>& free() {
+    static std::vector<size_t> f;
+    return f;
+  }
+  static size_t& next() {
+    static size_t n = 0;
+    return n;
+  }
+
+  size_t index_;
+};
+
+class Counter {
+ public:
+  void add(const uint64_t n = 1) noexcept {
+    const size_t i = metric_shard::index();
+    metric_shard::add(shards_[i].value, n, i);
+  }
+
+  uint64_t value() const noexcept {
+    uint64_t sum = 0;
+    for (auto& s : shards_) sum += s.value.load(std::memory_order_relaxed);
+    return sum;
+  }
+
+ private:
+  struct alignas(64) shard {
+    std::atomic<uint64_t> value{0};
+  };
+  std::array<shard, metric_shards + 1> shards_;
+};
+
+// Power-of-two buckets: bucket 0 counts zeros and bucket i values in [2^(i-1), 2^i), the last
+// one everything above.
+class Histogram {
+ public:
+  static constexpr size_t bucket_count = 48;
+
+  struct snapshot {
+    std::array<uint64_t, bucket_count> buckets{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    static uint64_t upper_bound(const size_t bucket) {
+      return bucket == 0 ? 0 : (uint64_t{1} << bucket) - 1;
+    }
+
+    // Upper bound of the bucket holding the q-quantile.
+    uint64_t quantile(const double q) const {
+      if (count == 0) return 0;
+      const auto rank = static_cast<uint64_t>(q * static_cast<double>(count - 1));
+      uint64_t seen = 0;
+      for (size_t i = 0; i < bucket_count; i++) {
+        seen += buckets[i];
+        if (seen > rank) return upper_bound(i);
+      }
+      return upper_bound(bucket_count - 1);
+    }
+  };
+
+  void record(const uint64_t value) noexcept {
+    const size_t i = metric_shard::index();
+    const auto bucket = std::min<size_t>(std::bit_width(value), bucket_count - 1);
+    metric_shard::add(shards_[i].buckets[bucket], 1, i);
+    metric_shard::add(shards_[i].sum, value, i);
+  }
+
+  snapshot read() const noexcept {
+    snapshot result;
+    for (auto& s : shards_) {
+      for (size_t i = 0; i < bucket_count; i++) {
+        const auto n = s.buckets[i].load(std::memory_order_relaxed);
+        result.buckets[i] += n;
+        result.count += n;
+      }
+      result.sum += s.sum.load(std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+ private:
+  struct alignas(64) shard {
+    std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+    std::atomic<uint64_t> sum{0};
+  };
+  std::array<shard, metric_shards + 1> shards_;
+};
+
+using metric_labels = std::vector<std::pair<std::string, std::string>>;
+
+// Every counter and histogram by name and labels. Lookups take a lock and are meant to happen
+// once per call site; the metrics themselves live as long as the program. Names are stored as
+// Prometheus exports them, so "a.b" and "a_b" are one metric.
+class MetricRegistry {
+ public:
+  static MetricRegistry& instance() {
+    static MetricRegistry registry;
+    return registry;
+  }
+
+  Counter& counter(const std::string_view name, const metric_labels& labels = {},
+                   const std::string_view help = {}) {
+    auto& e = find(name, labels, help, false);
+    return *e.counter;
+  }
+
+  Histogram& histogram(const std::string_view name, const metric_labels& labels = {},
+                       const std::string_view help = {}) {
+    auto& e = find(name, labels, help, true);
+    return *e.histogram;
+  }
+
+  // {"counters": [{"name", "labels", "value"}], "histograms": [{"name", "labels", "count",
+  // "sum", "p50", "p90", "p99", "buckets": {"upper bound": count}}]}
+  std::string to_json() const {
+    std::lock_guard<std::mutex> lock(mt_);
+    std::string counters, histograms;
+    for (auto& e : entries_) {
+      std::string item = "{\"name\":" + json_string(e.name) + ",\"labels\":{";
+      for (size_t i = 0; i < e.labels.size(); i++) {
+        if (i > 0) item += ',';
+        item += json_string(e.labels[i].first) + ":" + json_string(e.labels[i].second);
+      }
+      item += "},";
+      if (e.counter) {
+        item += "\"value\":" + std::to_string(e.counter->value()) + "}";
+        counters += (counters.empty() ? "" : ",") + item;
+        continue;
+      }
+      const auto s = e.histogram->read();
+      item += "\"count\":" + std::to_string(s.count) + ",\"sum\":" + std::to_string(s.sum) +
+              ",\"p50\":" + std::to_string(s.quantile(0.5)) +
+              ",\"p90\":" + std::to_string(s.quantile(0.9)) +
+              ",\"p99\":" + std::to_string(s.quantile(0.99)) + ",\"buckets\":{";
+      bool first = true;
+      for (size_t i = 0; i < Histogram::bucket_count; i++) {
+        if (s.buckets[i] == 0) continue;
+        item += (first ? "\"" : ",\"") + std::to_string(Histogram::snapshot::upper_bound(i)) +
+                "\":" + std::to_string(s.buckets[i]);
+        first = false;
+      }
+      item += "}}";
+      histograms += (histograms.empty() ? "" : ",") + item;
+    }
+    return "{\"counters\":[" + counters + "],\"histograms\":[" + histograms + "]}";
+  }
+
+  // Prometheus text exposition format, version 0.0.4. The series of one metric family are
+  // written together, families in the order they were first registered. Characters a label name
+  // cannot hold become '_'; metric names were already made valid when registered.
+  std::string to_prometheus() const {
+    std::lock_guard<std::mutex> lock(mt_);
+    std::vector<const entry*> sorted;
+    for (auto& e : entries_) sorted.push_back(&e);
+    std::stable_sort(sorted.begin(), sorted.end(), [](const entry* a, const entry* b) {
+      return a->family < b->family;
+    });
+
+    std::string out;
+    for (size_t k = 0; k < sorted.size(); k++) {
+      const entry& e = *sorted[k];
+      const std::string& name = e.name;
+      if (k == 0 || sorted[k - 1]->family != e.family) {
+        if (!e.help.empty()) out += "# HELP " + name + " " + escape(e.help, false) + "\n";
+        out += "# TYPE " + name + (e.counter ? " counter\n" : " histogram\n");
+      }
+      if (e.counter) {
+        out += name + label_text(e.labels) + " " + std::to_string(e.counter->value()) + "\n";
+        continue;
+      }
+      const auto s = e.histogram->read();
+      uint64_t cumulative = 0;
+      size_t last = 0;
+      for (size_t i = 0; i < Histogram::bucket_count; i++) {
+        if (s.buckets[i] > 0) last = i;
+      }
+      for (size_t i = 0; i <= last && i + 1 < Histogram::bucket_count; i++) {
+        cumulative += s.buckets[i];
+        out += name + "_bucket" +
+               label_text(e.labels,
+                          {"le", std::to_string(Histogram::snapshot::upper_bound(i))}) +
+               " " + std::to_string(cumulative) + "\n";
+      }
+      out += name + "_bucket" + label_text(e.labels, {"le", "+Inf"}) + " " +
+             std::to_string(s.count) + "\n";
+      out += name + "_sum" + label_text(e.labels) + " " + std::to_string(s.sum) + "\n";
+      out += name + "_count" + label_text(e.labels) + " " + std::to_string(s.count) + "\n";
+    }
+    return out;
+  }
+
+ private:
+  struct entry {
+    std::string name;
+    metric_labels labels;
+    std::string help;
+    size_t family;  // registration order of the first entry with this name
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Histogram> histogram;
+  };
+
+  entry& find(const std::string_view raw_name, const metric_labels& labels,
+              const std::string_view help, const bool histogram) {
+    // the exported name is the key, two names that export alike would otherwise be two families
+    const std::string name = prometheus_name(raw_name, true);
+    std::lock_guard<std::mutex> lock(mt_);
+    size_t family = families_;
+    for (auto& e : entries_) {
+      if (e.name != name) continue;
+      // all series of a family have one type
+      if ((e.histogram != nullptr) != histogram)
+        throw std::invalid_argument("Metric " + e.name + " has another type");
+      family = e.family;
+      if (e.labels == labels) return e;
+    }
+    if (family == families_) families_++;
+    auto& e = entries_.emplace_back(
+        entry{name, labels, std::string(help), family, {}, {}});
+    if (histogram) {
+      e.histogram = std::make_unique<Histogram>();
+    } else {
+      e.counter = std::make_unique<Counter>();
+    }
+    return e;
+  }
+
+  // [a-zA-Z_:][a-zA-Z0-9_:]* for metric names, the same without ':' for label names.
+  static std::string prometheus_name(const std::string_view name, const bool metric) {
+    std::string out(name);
+    for (size_t i = 0; i < out.size(); i++) {
+      const char c = out[i];
+      const bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+                      (c == ':' && metric) || (c >= '0' && c <= '9' && i > 0);
+      if (!ok) out[i] = '_';
+    }
+    return out.empty() ? "_" : out;
+  }
+
+  // Backslash and newline, and double quotes in label values.
+  static std::string escape(const std::string_view text, const bool quotes) {
+    std::string out;
+    for (const char c : text) {
+      if (c == '\\' || (c == '"' && quotes)) {
+        out += '\\';
+        out += c;
+      } else if (c == '\n') {
+        out += "\\n";
+      } else {
+        out += c;
+      }
+    }
+    return out;
+  }
+
+  static std::string json_string(const std::string_view text) {
+    std::string out = "\"";
+    for (const char c : text) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+        out += buf;
+      } else {
+        out += c;
+      }
+    }
+    return out + "\"";
+  }
+
+  static std::string label_text(const metric_labels& labels,
+                                const std::pair<std::string, std::string>& extra = {}) {
+    std::string out;
+    auto add = [&out](const std::string_view key, const std::string_view value) {
+      out += (out.empty() ? "" : ",") + prometheus_name(key, false) + "=\"" +
+             escape(value, true) + "\"";
+    };
+    for (auto& [key, value] : labels) add(key, value);
+    if (!extra.first.empty()) add(extra.first, extra.second);
+    return out.empty() ? out : "{" + out + "}";
+  }
+
+  mutable std::mutex mt_;
+  std::deque<entry> entries_;
+  size_t families_ = 0;
+};
+
+// Start of an interval being measured; empty, and free to copy around, without
+// instrumentation.
+template <bool enabled = instrumentation>
+struct Stopwatch {
+  void start() noexcept { ns = raw_clock::now_ns(); }
+  uint64_t elapsed_ns() const noexcept { return raw_clock::now_ns() - ns; }
+  uint64_t ns = 0;
+};
+
+template <>
+struct Stopwatch<false> {
+  void start() noexcept {}
+  uint64_t elapsed_ns() const noexcept { return 0; }
+};
+
+// A mutex that counts acquisitions and contended acquisitions and records wait and hold times
+// in nanoseconds, labelled with a name that all mutexes of one role share. Without
+// instrumentation it holds nothing but the Mutex and forwards to it.
+template <typename Mutex = std::mutex, bool enabled = instrumentation>
+class InstrumentedMutex {
+ public:
+  explicit InstrumentedMutex(const std::string_view name) {
+    if constexpr (enabled) {
+      auto& registry = MetricRegistry::instance();
+      const metric_labels labels = {{"mutex", std::string(name)}};
+      stats_.acquisitions = &registry.counter("mutex_acquisitions_total", labels,
+                                              "Times the mutex was locked");
+      stats_.contended = &registry.counter("mutex_contended_total", labels,
+                                           "Times a lock had to wait for another holder");
+      stats_.wait = &registry.histogram("mutex_wait_ns", labels, "Time spent waiting to lock");
+      stats_.hold = &registry.histogram("mutex_hold_ns", labels, "Time the mutex was held");
+    }
+  }
+
+  InstrumentedMutex(const InstrumentedMutex&) = delete;
+  InstrumentedMutex& operator=(const InstrumentedMutex&) = delete;
+
+  void lock() {
+    if constexpr (enabled) {
+      if (mt_.try_lock()) {
+        stats_.held.start();
+        stats_.wait->record(0);
+      } else {
+        Stopwatch<true> waiting;
+        waiting.start();
+        mt_.lock();
+        stats_.held.start();
+        stats_.wait->record(stats_.held.ns - waiting.ns);
+        stats_.contended->add();
+      }
+      stats_.acquisitions->add();
+    } else {
+      mt_.lock();
+    }
+  }
+
+  bool try_lock() {
+    if (!mt_.try_lock()) return false;
+    if constexpr (enabled) {
+      stats_.held.start();
+      stats_.wait->record(0);
+      stats_.acquisitions->add();
+    }
+    return true;
+  }
+
+  void unlock() {
+    if constexpr (enabled) stats_.hold->record(stats_.held.elapsed_ns());
+    mt_.unlock();
+  }
+
+ private:
+  struct stats {
+    Counter* acquisitions = nullptr;
+    Counter* contended = nullptr;
+    Histogram* wait = nullptr;
+    Histogram* hold = nullptr;
+    Stopwatch<true> held;  // written by the holder only
+  };
+  struct none {};
+
+  Mutex mt_;
+  [[no_unique_address]] std::conditional_t<enabled, stats, none> stats_;
+};
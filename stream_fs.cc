@@ -1,24 +1,61 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pwd.h>
 #include <stdlib.h>
-#include <sys/sysctl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <uuid/uuid.h>
 
 #include <algorithm>
+#include <array>
+#include <cassert>
+#include <cerrno>
+#include <atomic>
+#include <bit>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <optional>
 #include <regex>
+#include <set>
+#include <shared_mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "fs_walk.h"
+#include "instrument.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 unsigned number_of_digits(const unsigned i) { return i > 0 ? (int)log10((double)i) + 1 : i; }
 
 void print_pascal_triangle(int n) {
@@ -37,6 +74,319 @@ void print_pascal_triangle(int n) {
 
 void test_print_pascal_triangle() { print_pascal_triangle(5); }
 
+void remove_empty_lines(std::filesystem::path filepath) {
+  std::ifstream filein(filepath.native(), std::ios::in);
+
+  if (!filein.is_open()) throw std::runtime_error("Cannot open input file");
+  auto temppath = std::filesystem::temp_directory_path() / "tmep.txt";
+  std::ofstream fileout(temppath.native(), std::ios::out | std::ios::trunc);
+  if (!fileout.is_open()) throw std::runtime_error("Cannot create temporary file");
+
+  std::string line;
+  while (std::getline(filein, line)) {
+    if (line.length() > 0 && line.find_first_not_of(' ') != line.npos) fileout << line << '\n';
+  }
+
+  filein.close();
+  fileout.close();
+  std::filesystem::remove(filepath);
+  std::filesystem::rename(temppath, filepath);
+}
+
+void test_remove_empty_lines() {
+  auto filepath = std::filesystem::path("./sample.txt");
+  remove_empty_lines(filepath);
+}
+
+unsigned long long get_directory_size(const std::filesystem::path &dir,
+                                      const bool follow_symlinks = false) {
+  auto iter = std::filesystem::recursive_directory_iterator(
+      dir, follow_symlinks ? std::filesystem::directory_options::follow_directory_symlink
+                           : std::filesystem::directory_options::none);
+  return std::accumulate(
+      std::filesystem::begin(iter), std::filesystem::end(iter), 0ULL,
+      [](const unsigned long long total, const std::filesystem::directory_entry &entry) {
+        return total + (std::filesystem::is_regular_file(entry)
+                            ? std::filesystem::file_size(entry.path())
+                            : 0ULL);
+      });
+}
+
+void test_get_directory_size() {
+  auto path = std::filesystem::path(".");
+  std::cout << get_directory_size(path) << std::endl;
+}
+
+namespace fs = std::filesystem;
+namespace ch = std::chrono;
+
+struct file_id {
+  uint64_t dev;
+  uint64_t ino;
+  bool operator==(const file_id &) const = default;
+};
+
+struct file_id_hash {
+  size_t operator()(const file_id &id) const noexcept {
+    return id.ino * 0x9E3779B97F4A7C15ULL ^ id.dev;
+  }
+};
+
+// Per-directory subtotals that survive between scans. A directory whose mtime is unchanged has
+// the same entries as last time, so neither its listing nor its files are stat'ed again. Files
+// rewritten in place without touching the directory are not noticed.
+class DirectorySizeIndex {
+ public:
+  struct linked_file {
+    file_id id;
+    uint64_t size;
+  };
+
+  struct entry {
+    int64_t mtime_sec = 0;
+    uint32_t mtime_nsec = 0;
+    uint64_t bytes = 0;
+    std::vector<linked_file> linked;
+    std::vector<std::string> subdirs;
+  };
+
+  void load(const fs::path &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) return;
+
+    auto read = [&in](auto &value) { in.read(reinterpret_cast<char *>(&value), sizeof(value)); };
+    auto read_string = [&in, &read](std::string &s) {
+      uint32_t len = 0;
+      read(len);
+      s.resize(len);
+      in.read(s.data(), len);
+    };
+
+    uint32_t magic = 0, count = 0;
+    read(magic);
+    if (magic != file_magic) return;
+    read(count);
+    for (uint32_t i = 0; i < count && in; i++) {
+      std::string dir;
+      entry e;
+      uint32_t nlinked = 0, nsub = 0;
+      read_string(dir);
+      read(e.mtime_sec);
+      read(e.mtime_nsec);
+      read(e.bytes);
+      read(nlinked);
+      e.linked.resize(nlinked);
+      for (auto &l : e.linked) read(l);
+      read(nsub);
+      e.subdirs.resize(nsub);
+      for (auto &s : e.subdirs) read_string(s);
+      if (in) entries_.insert_or_assign(std::move(dir), std::move(e));
+    }
+  }
+
+  void save(const fs::path &path) const {
+    auto temppath = path;
+    temppath += ".tmp";
+    {
+      std::ofstream out(temppath, std::ios::binary | std::ios::trunc);
+      if (!out.is_open()) throw std::runtime_error("Cannot create index file");
+
+      auto write = [&out](const auto &value) {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+      };
+      auto write_string = [&out, &write](const std::string &s) {
+        write(static_cast<uint32_t>(s.size()));
+        out.write(s.data(), s.size());
+      };
+
+      std::lock_guard<std::mutex> lock(mt_);
+      write(file_magic);
+      write(static_cast<uint32_t>(entries_.size()));
+      for (const auto &[dir, e] : entries_) {
+        write_string(dir);
+        write(e.mtime_sec);
+        write(e.mtime_nsec);
+        write(e.bytes);
+        write(static_cast<uint32_t>(e.linked.size()));
+        for (const auto &l : e.linked) write(l);
+        write(static_cast<uint32_t>(e.subdirs.size()));
+        for (const auto &s : e.subdirs) write_string(s);
+      }
+      if (!out) throw std::runtime_error("Cannot write index file");
+    }
+    fs::rename(temppath, path);
+  }
+
+  std::optional<entry> find(const std::string &dir, const struct statx_timestamp &mtime) {
+    std::lock_guard<std::mutex> lock(mt_);
+    auto it = entries_.find(dir);
+    if (it == entries_.end() || it->second.mtime_sec != mtime.tv_sec ||
+        it->second.mtime_nsec != mtime.tv_nsec)
+      return std::nullopt;
+    used_.insert(dir);
+    return it->second;
+  }
+
+  void store(const std::string &dir, entry e) {
+    std::lock_guard<std::mutex> lock(mt_);
+    entries_.insert_or_assign(dir, std::move(e));
+    used_.insert(dir);
+  }
+
+  // Drops the entries of root and below that the last walk of root did not use: directories
+  // that were removed or renamed since.
+  void prune(const std::string &root) {
+    std::lock_guard<std::mutex> lock(mt_);
+    const auto prefix = join_path(root, "");
+    std::erase_if(entries_, [&](const auto &item) {
+      const auto &dir = item.first;
+      return (dir == root || dir.starts_with(prefix)) && !used_.contains(dir);
+    });
+    used_.clear();
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mt_);
+    return entries_.size();
+  }
+
+ private:
+  static constexpr uint32_t file_magic = 0x31585A44;  // "DZX1"
+
+  mutable std::mutex mt_;
+  std::unordered_map<std::string, entry> entries_;
+  std::unordered_set<std::string> used_;  // entries found or stored since the last prune
+};
+
+struct directory_size_options {
+  bool follow_symlinks = false;
+  unsigned threads = std::thread::hardware_concurrency();
+  std::optional<fs::path> index;
+};
+
+unsigned long long parallel_directory_size(const fs::path &dir,
+                                           const directory_size_options &options = {}) {
+  constexpr unsigned mask = STATX_TYPE | STATX_MODE | STATX_INO | STATX_NLINK | STATX_SIZE |
+                            STATX_MTIME;
+  const int stat_flags = options.follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+
+  DirectorySizeIndex index;
+  if (options.index) index.load(*options.index);
+
+  std::atomic<unsigned long long> total{0};
+  std::mutex linked_mt;
+  std::unordered_set<file_id, file_id_hash> linked;
+  std::unordered_set<file_id, file_id_hash> visited_dirs;
+  const auto root = dir.string();
+
+  auto count_linked = [&](const std::vector<DirectorySizeIndex::linked_file> &files) {
+    unsigned long long bytes = 0;
+    std::lock_guard<std::mutex> lock(linked_mt);
+    for (const auto &f : files) {
+      if (linked.insert(f.id).second) bytes += f.size;
+    }
+    return bytes;
+  };
+
+  parallel_walk(
+      dir,
+      [&](const std::string &path, auto &spawn) {
+        struct statx self;
+        if (statx(AT_FDCWD, path.c_str(), 0, mask, &self) != 0) {
+          if (path == root) throw std::runtime_error("Cannot open directory");
+          return;
+        }
+        if (options.follow_symlinks) {
+          std::lock_guard<std::mutex> lock(linked_mt);
+          if (!visited_dirs.insert({makedev(self.stx_dev_major, self.stx_dev_minor), self.stx_ino})
+                   .second)
+            return;
+        }
+
+        if (options.index) {
+          if (auto cached = index.find(path, self.stx_mtime)) {
+            total += cached->bytes + count_linked(cached->linked);
+            for (const auto &sub : cached->subdirs) spawn(join_path(path, sub));
+            return;
+          }
+        }
+
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+          if (path == root) throw std::runtime_error("Cannot open directory");
+          return;
+        }
+
+        DirectorySizeIndex::entry e;
+        e.mtime_sec = self.stx_mtime.tv_sec;
+        e.mtime_nsec = self.stx_mtime.tv_nsec;
+        try {
+          read_directory(fd, [&](std::string_view name, unsigned char, ino_t) {
+            struct statx st;
+            if (statx(fd, std::string(name).c_str(), stat_flags, mask, &st) != 0) return;
+            if (S_ISDIR(st.stx_mode)) {
+              e.subdirs.emplace_back(name);
+              spawn(join_path(path, name));
+            } else if (S_ISREG(st.stx_mode)) {
+              if (st.stx_nlink > 1)
+                e.linked.push_back(
+                    {{makedev(st.stx_dev_major, st.stx_dev_minor), st.stx_ino}, st.stx_size});
+              else
+                e.bytes += st.stx_size;
+            }
+          });
+        } catch (...) {
+          close(fd);
+          throw;
+        }
+        close(fd);
+
+        total += e.bytes + count_linked(e.linked);
+        if (options.index) index.store(path, std::move(e));
+      },
+      options.threads);
+
+  if (options.index) {
+    index.prune(root);
+    index.save(*options.index);
+  }
+  return total;
+}
+
+void test_parallel_directory_size() {
+  auto path = fs::path(".");
+  auto index = fs::temp_directory_path() / "directory_size.idx";
+  auto expected = get_directory_size(path);
+  auto size = parallel_directory_size(path);
+  std::cout << expected << " " << size << std::endl;
+  assert(parallel_directory_size(path, {.index = index}) == size);
+  assert(parallel_directory_size(path, {.index = index}) == size);
+  fs::remove(index);
+
+  // hard links count once, and entries of removed directories leave the index
+  auto root = fs::temp_directory_path() / "directory_size_test";
+  fs::remove_all(root);
+  fs::create_directories(root / "a" / "b");
+  fs::create_directories(root / "c");
+  std::ofstream(root / "a" / "one") << std::string(100, 'x');
+  std::ofstream(root / "a" / "b" / "two") << std::string(200, 'x');
+  std::ofstream(root / "c" / "three") << std::string(50, 'x');
+  fs::create_hard_link(root / "c" / "three", root / "a" / "b" / "link");
+  assert(parallel_directory_size(root, {.index = index}) == 350);
+
+  auto entries = [&index]() {
+    DirectorySizeIndex loaded;
+    loaded.load(index);
+    return loaded.size();
+  };
+  assert(entries() == 4);
+  fs::remove_all(root / "a");
+  assert(parallel_directory_size(root, {.index = index}) == 50);
+  assert(entries() == 2);
+  fs::remove_all(root);
+  fs::remove(index);
+}
+
 enum class procstatus { idle, running, sleep, stop, zombie };
 
 struct procinfo {
@@ -45,57 +395,253 @@ struct procinfo {
   procstatus status;
   std::string account;
   uint64_t memory;
+  double cpu = 0;  // percent of one core since the previous sample, delta mode only
 };
 
-procstatus stat2procstatus(int stat) {
+procstatus stat2procstatus(const char stat) {
   switch (stat) {
-    case SIDL:
+    case 'I':
       return procstatus::idle;
-    case SRUN:
+    case 'R':
       return procstatus::running;
-    case SSLEEP:
+    case 'S':
+    case 'D':
       return procstatus::sleep;
-    case SSTOP:
+    case 'T':
+    case 't':
       return procstatus::stop;
-    case SZOMB:
-      return procstatus::zombie;
     default:
       return procstatus::zombie;
   }
 }
 
+class UserNameCache {
+ public:
+  std::string lookup(const uid_t uid) {
+    {
+      std::shared_lock lock(mt_);
+      if (auto it = names_.find(uid); it != names_.end()) return it->second;
+    }
+    struct passwd pw, *result = nullptr;
+    char buf[4096];
+    std::string name = getpwuid_r(uid, &pw, buf, sizeof(buf), &result) == 0 && result
+                           ? std::string(pw.pw_name)
+                           : std::to_string(uid);
+    std::unique_lock lock(mt_);
+    return names_.emplace(uid, std::move(name)).first->second;
+  }
+
+ private:
+  std::shared_mutex mt_;
+  std::unordered_map<uid_t, std::string> names_;
+};
+
+// Collects process information from /proc/<pid>/{stat,status,statm} with openat/pread only.
+// In delta mode the three descriptors of each process stay open between samples, so a refresh
+// costs three preads per process, and CPU usage is derived from the utime+stime difference.
+class ProcessSampler {
+ public:
+  explicit ProcessSampler(const bool keep_open = false,
+                          const unsigned num_thread = std::thread::hardware_concurrency())
+      : keep_open_(keep_open), num_thread_(std::max(1u, num_thread)) {
+    proc_fd_ = ::open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc_fd_ < 0) throw std::runtime_error("Cannot open /proc");
+    ticks_per_second_ = sysconf(_SC_CLK_TCK);
+    page_size_ = sysconf(_SC_PAGESIZE);
+    // kept descriptors may use half the limit, the rest is left to the program and to the
+    // descriptors opened for a single read
+    rlimit limit;
+    if (keep_open_ && getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+      fd_budget_ = limit.rlim_cur / 2;
+  }
+
+  ProcessSampler(const ProcessSampler &) = delete;
+  ProcessSampler &operator=(const ProcessSampler &) = delete;
+
+  ~ProcessSampler() {
+    for (auto &[pid, p] : processes_) p.close();
+    ::close(proc_fd_);
+  }
+
+  std::vector<procinfo> sample() {
+    auto now = ch::steady_clock::now();
+    auto elapsed = ch::duration<double>(now - last_sample_).count();
+    last_sample_ = now;
+
+    ::lseek(proc_fd_, 0, SEEK_SET);
+    std::vector<int> pids;
+    read_directory(proc_fd_, [&pids](std::string_view name, unsigned char, ino_t) {
+      int pid = 0;
+      for (char c : name) {
+        if (c < '0' || c > '9') return;
+        pid = pid * 10 + (c - '0');
+      }
+      pids.push_back(pid);
+    });
+
+    ++generation_;
+    std::vector<process *> work;
+    work.reserve(pids.size());
+    for (int pid : pids) {
+      auto &p = processes_[pid];
+      p.pid = pid;
+      p.generation = generation_;
+      work.push_back(&p);
+    }
+    for (auto it = processes_.begin(); it != processes_.end();) {
+      if (it->second.generation == generation_) {
+        ++it;
+      } else {
+        kept_fds_ -= it->second.close();
+        it = processes_.erase(it);
+      }
+    }
+
+    std::vector<std::optional<procinfo>> results(work.size());
+    auto collect = [&](size_t first, size_t last) {
+      std::string buf(4096, '\0');
+      for (size_t i = first; i < last; i++) results[i] = read_process(*work[i], buf, elapsed);
+    };
+    const size_t chunks = work.size() < 256 ? 1 : num_thread_;
+    std::vector<std::thread> threads;
+    for (size_t k = 1; k < chunks; k++) {
+      threads.emplace_back(collect, work.size() * k / chunks, work.size() * (k + 1) / chunks);
+    }
+    collect(0, work.size() / chunks);
+    for (auto &t : threads) t.join();
+
+    std::vector<procinfo> procs;
+    procs.reserve(results.size());
+    for (auto &r : results) {
+      if (r) procs.push_back(std::move(*r));
+    }
+    return procs;
+  }
+
+ private:
+  struct process {
+    int pid = 0;
+    uint64_t generation = 0;
+    std::array<int, 3> fds = {-1, -1, -1};  // stat, status, statm
+    uint64_t cpu_ticks = 0;
+    bool sampled = false;
+
+    // Returns how many descriptors were open.
+    int close() {
+      int closed = 0;
+      for (auto &fd : fds) {
+        if (fd >= 0) {
+          ::close(fd);
+          closed++;
+        }
+        fd = -1;
+      }
+      return closed;
+    }
+  };
+
+  static constexpr std::array<const char *, 3> file_names = {"stat", "status", "statm"};
+
+  // Reads one /proc file into buf. A kept descriptor that went stale means the pid was reused,
+  // so everything known about the old process is dropped before reopening. Descriptors are kept
+  // while within the budget; past it, or once the limit was hit, files are opened per read.
+  bool read_file(process &p, const int which, std::string &buf) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+      const bool kept = p.fds[which] >= 0;
+      int fd = p.fds[which];
+      if (fd < 0) {
+        char path[32];
+        std::snprintf(path, sizeof(path), "%d/%s", p.pid, file_names[which]);
+        fd = ::openat(proc_fd_, path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+          // stop keeping more and make room with this process' own descriptors
+          fd_budget_ = 0;
+          kept_fds_ -= p.close();
+          fd = ::openat(proc_fd_, path, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd < 0) return false;
+      }
+
+      size_t size = 0;
+      ssize_t n;
+      while ((n = ::pread(fd, buf.data() + size, buf.size() - size, size)) > 0) {
+        size += n;
+        if (size == buf.size()) buf.resize(buf.size() * 2);
+      }
+      if (n == 0 && (kept || (keep_open_ && kept_fds_++ < fd_budget_))) {
+        p.fds[which] = fd;
+      } else {
+        if (n == 0 && keep_open_) kept_fds_--;
+        ::close(fd);
+        if (kept) kept_fds_--;
+        p.fds[which] = -1;
+      }
+      if (n == 0) {
+        buf[size] = '\0';
+        return true;
+      }
+      if (errno != ESRCH || !kept) return false;
+      kept_fds_ -= p.close();
+      p.sampled = false;
+      p.cpu_ticks = 0;
+    }
+    return false;
+  }
+
+  std::optional<procinfo> read_process(process &p, std::string &buf, const double elapsed) {
+    procinfo info;
+    info.pid = p.pid;
+
+    if (!read_file(p, 0, buf)) return std::nullopt;
+    auto open_paren = buf.find('(');
+    auto close_paren = buf.rfind(')');
+    if (open_paren == std::string::npos || close_paren == std::string::npos) return std::nullopt;
+    info.name = buf.substr(open_paren + 1, close_paren - open_paren - 1);
+    const char *s = buf.c_str() + close_paren + 2;
+    info.status = stat2procstatus(*s);
+    // utime and stime are fields 14 and 15; s points at field 3
+    for (int field = 3; field < 14 && *s; s++) {
+      if (*s == ' ') field++;
+    }
+    char *end;
+    uint64_t ticks = std::strtoull(s, &end, 10);
+    ticks += std::strtoull(end, &end, 10);
+    if (p.sampled && elapsed > 0 && ticks >= p.cpu_ticks)
+      info.cpu = 100.0 * (ticks - p.cpu_ticks) / ticks_per_second_ / elapsed;
+    p.cpu_ticks = ticks;
+    p.sampled = true;
+
+    uid_t uid = 0;
+    if (read_file(p, 1, buf)) {
+      if (auto pos = buf.find("\nUid:"); pos != std::string::npos)
+        uid = std::strtoul(buf.c_str() + pos + 5, nullptr, 10);
+    }
+    info.account = users_.lookup(uid);
+
+    info.memory = 0;
+    if (read_file(p, 2, buf)) {
+      std::strtoull(buf.c_str(), &end, 10);
+      info.memory = std::strtoull(end, nullptr, 10) * page_size_;
+    }
+    return info;
+  }
+
+  bool keep_open_;
+  std::atomic<size_t> fd_budget_ = std::numeric_limits<size_t>::max();
+  std::atomic<size_t> kept_fds_ = 0;
+  unsigned num_thread_;
+  int proc_fd_;
+  long ticks_per_second_;
+  long page_size_;
+  uint64_t generation_ = 0;
+  ch::steady_clock::time_point last_sample_ = ch::steady_clock::now();
+  std::unordered_map<int, process> processes_;
+  UserNameCache users_;
+};
+
 std::vector<procinfo> get_process() {
-  int mib[4] = {CTL_KERN, KERN_PROC, KERN_PROC_ALL, 0};
-  struct kinfo_proc *info;
-  size_t length;
-
-  if (sysctl(mib, 4, NULL, &length, NULL, 0) < 0) throw std::invalid_argument("TODO");
-  if (!(info = (kinfo_proc *)malloc(length))) throw std::invalid_argument("TODO");
-  if (sysctl(mib, 4, info, &length, NULL, 0) < 0) {
-    free(info);
-    throw std::invalid_argument("TODO");
-  }
-
-  std::vector<procinfo> procs;
-  int count = length / sizeof(struct kinfo_proc);
-  for (int i = 0; i < count; i++) {
-    pid_t pid = info[i].kp_proc.p_pid;
-    uid_t uid = info[i].kp_eproc.e_pcred.p_ruid;
-    char *username = user_from_uid(uid, 0);
-    char *command = info[i].kp_proc.p_comm;
-    int stat = info[i].kp_proc.p_stat;
-
-    procinfo pinfo;
-    pinfo.pid = pid;
-    pinfo.name = std::string(command);
-    pinfo.status = stat2procstatus(stat);
-    pinfo.account = std::string(username);
-    pinfo.memory = 0;
-    procs.push_back(pinfo);
-  }
-
-  free(info);
-  return procs;
+  ProcessSampler sampler;
+  return sampler.sample();
 }
 
 std::string status_to_string(const procstatus status) {
@@ -111,13 +657,16 @@ std::string status_to_string(const procstatus status) {
     case procstatus::zombie:
       return "zombie";
   }
+  return "unknown";
 }
 
-void print_processes() {
-  auto processes = get_process();
+void print_processes(std::vector<procinfo> processes) {
   std::sort(processes.begin(), processes.end(),
             [](const procinfo &p1, const procinfo &p2) { return p1.name < p2.name; });
 
+  // the alignment, fill and precision set below are the caller's again on return
+  std::ios format(nullptr);
+  format.copyfmt(std::cout);
   for (const auto &p : processes) {
     std::cout << std::left << std::setw(25) << std::setfill(' ') << p.name;
     std::cout << std::left << std::setw(8) << std::setfill(' ') << p.pid;
@@ -125,55 +674,236 @@ void print_processes() {
     std::cout << std::left << std::setw(15) << std::setfill(' ') << p.account;
     std::cout << std::left << std::setw(10) << std::setfill(' ')
               << static_cast<int>(p.memory / 1024);
+    std::cout << std::fixed << std::setprecision(1) << p.cpu;
     std::cout << std::endl;
   }
+  std::cout.copyfmt(format);
 }
 
-void remove_empty_lines(std::filesystem::path filepath) {
-  std::ifstream filein(filepath.native(), std::ios::in);
+void print_processes() { print_processes(get_process()); }
 
-  if (!filein.is_open()) throw std::runtime_error("Cannot open input file");
-  auto temppath = std::filesystem::temp_directory_path() / "tmep.txt";
-  std::ofstream fileout(temppath.native(), std::ios::out | std::ios::trunc);
-  if (!fileout.is_open()) throw std::runtime_error("Cannot create temporary file");
+void test_process_sampler() {
+  const auto flags = std::cout.flags();
+  const auto precision = std::cout.precision();
+  print_processes();
+  assert(std::cout.flags() == flags && std::cout.precision() == precision);
 
-  std::string line;
-  while (std::getline(filein, line)) {
-    if (line.length() > 0 && line.find_first_not_of(' ') != line.npos) fileout << line << '\n';
+  {
+    ProcessSampler sampler(true);
+    for (int i = 0; i < 10; i++) {
+      auto start = ch::steady_clock::now();
+      auto procs = sampler.sample();
+      auto elapsed = ch::duration_cast<ch::microseconds>(ch::steady_clock::now() - start);
+      std::cout << procs.size() << " processes in " << elapsed.count() << "us" << std::endl;
+      std::this_thread::sleep_for(ch::milliseconds(100));
+    }
   }
 
-  filein.close();
-  fileout.close();
-  std::filesystem::remove(filepath);
-  std::filesystem::rename(temppath, filepath);
+  // fewer descriptors than three per process: keep what fits, open the rest per read
+  rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  rlimit low = limit;
+  low.rlim_cur = 32;
+  setrlimit(RLIMIT_NOFILE, &low);
+  {
+    ProcessSampler few(true);
+    const auto expected = ProcessSampler().sample().size();
+    for (int i = 0; i < 3; i++) assert(few.sample().size() >= expected * 9 / 10);
+  }
+  setrlimit(RLIMIT_NOFILE, &limit);
 }
 
-void test_remove_empty_lines() {
-  auto filepath = std::filesystem::path("./sample.txt");
-  remove_empty_lines(filepath);
+// Bit i of the results marks byte i of the 64 bytes at p: a newline, or a byte that makes the
+// line non-blank (anything except ' ' and '\n').
+inline void scan_block(const char *p, uint64_t &newlines, uint64_t &content) {
+#if defined(__SSE2__)
+  newlines = content = 0;
+  const auto nl = _mm_set1_epi8('\n');
+  const auto sp = _mm_set1_epi8(' ');
+  for (int k = 0; k < 4; k++) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * k));
+    auto is_nl = static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    auto is_sp = static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, sp)));
+    newlines |= is_nl << (16 * k);
+    content |= (~(is_nl | is_sp) & 0xFFFF) << (16 * k);
+  }
+#else
+  newlines = content = 0;
+  for (int k = 0; k < 64; k++) {
+    newlines |= static_cast<uint64_t>(p[k] == '\n') << k;
+    content |= static_cast<uint64_t>(p[k] != '\n' && p[k] != ' ') << k;
+  }
+#endif
 }
 
-unsigned long long get_directory_size(const std::filesystem::path &dir,
-                                      const bool follow_symlinks = false) {
-  auto iter = std::filesystem::recursive_directory_iterator(
-      dir, follow_symlinks ? std::filesystem::directory_options::follow_directory_symlink
-                           : std::filesystem::directory_options::none);
-  return std::accumulate(
-      std::filesystem::begin(iter), std::filesystem::end(iter), 0ULL,
-      [](const unsigned long long total, const std::filesystem::directory_entry &entry) {
-        return total + (std::filesystem::is_regular_file(entry)
-                            ? std::filesystem::file_size(entry.path())
-                            : 0ULL);
-      });
-}
+class AlignedFileWriter {
+ public:
+  AlignedFileWriter(const int fd, const size_t size) : fd_(fd), size_(size) {
+    buf_ = static_cast<char *>(std::aligned_alloc(4096, size_));
+    if (!buf_) throw std::bad_alloc();
+  }
+  ~AlignedFileWriter() { std::free(buf_); }
 
-void test_get_directory_size() {
-  auto path = std::filesystem::path(".");
-  std::cout << get_directory_size(path) << std::endl;
+  void write(const char *data, size_t size) {
+    while (size > 0) {
+      auto n = std::min(size, size_ - used_);
+      std::memcpy(buf_ + used_, data, n);
+      used_ += n;
+      data += n;
+      size -= n;
+      if (used_ == size_) flush();
+    }
+  }
+
+  void flush() {
+    for (size_t done = 0; done < used_;) {
+      auto n = ::write(fd_, buf_ + done, used_ - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0) throw std::runtime_error("Cannot write temporary file");
+      done += n;
+    }
+    used_ = 0;
+  }
+
+ private:
+  int fd_;
+  size_t size_;
+  size_t used_ = 0;
+  char *buf_;
+};
+
+// Same result as remove_empty_lines, but the input is memory mapped and scanned 64 bytes at a
+// time, and the output goes to an anonymous O_TMPFILE in the same directory which is linked
+// under a unique name and renamed over the original only once it is complete.
+void remove_empty_lines_mmap(const fs::path &filepath) {
+  int in = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0) throw std::runtime_error("Cannot open input file");
+  struct stat st;
+  if (fstat(in, &st) != 0) {
+    ::close(in);
+    throw std::runtime_error("Cannot stat input file");
+  }
+
+  auto dir = filepath.has_parent_path() ? filepath.parent_path() : fs::path(".");
+  std::string temppath;
+  int out = ::open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, st.st_mode & 07777);
+  if (out < 0) {
+    temppath = (dir / (filepath.filename().string() + ".XXXXXX")).string();
+    out = mkostemp(temppath.data(), O_CLOEXEC);
+  }
+  if (out < 0) {
+    ::close(in);
+    throw std::runtime_error("Cannot create temporary file");
+  }
+
+  const size_t size = st.st_size;
+  const char *data = nullptr;
+  if (size > 0) {
+    auto *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0);
+    if (p == MAP_FAILED) {
+      ::close(in);
+      ::close(out);
+      if (!temppath.empty()) fs::remove(temppath);
+      throw std::runtime_error("Cannot map input file");
+    }
+    madvise(p, size, MADV_SEQUENTIAL);
+    data = static_cast<const char *>(p);
+  }
+
+  try {
+    AlignedFileWriter writer(out, 1 << 20);
+    size_t run_start = 0;   // start of the kept lines not written yet
+    size_t line_start = 0;  // start of the current line
+    bool has_content = false;
+
+    auto end_line = [&](const size_t newline) {
+      if (!has_content) {
+        writer.write(data + run_start, line_start - run_start);
+        run_start = newline + 1;
+      }
+      line_start = newline + 1;
+      has_content = false;
+    };
+
+    size_t pos = 0;
+    for (; pos + 64 <= size; pos += 64) {
+      uint64_t newlines, content;
+      scan_block(data + pos, newlines, content);
+      while (newlines) {
+        auto bit = std::countr_zero(newlines);
+        auto below = (uint64_t{1} << bit) - 1;
+        auto from = line_start > pos ? ~((uint64_t{1} << (line_start - pos)) - 1) : ~uint64_t{0};
+        has_content |= (content & below & from) != 0;
+        end_line(pos + bit);
+        newlines &= newlines - 1;
+      }
+      if (line_start < pos + 64) {
+        auto from = line_start > pos ? ~((uint64_t{1} << (line_start - pos)) - 1) : ~uint64_t{0};
+        has_content |= (content & from) != 0;
+      }
+    }
+    for (; pos < size; pos++) {
+      if (data[pos] == '\n')
+        end_line(pos);
+      else if (data[pos] != ' ')
+        has_content = true;
+    }
+
+    if (line_start < size && !has_content) {
+      writer.write(data + run_start, line_start - run_start);
+    } else {
+      writer.write(data + run_start, size - run_start);
+      if (line_start < size) writer.write("\n", 1);
+    }
+    writer.flush();
+    if (fchmod(out, st.st_mode & 07777) != 0) throw std::runtime_error("Cannot set permissions");
+
+    if (temppath.empty()) {
+      temppath = (dir / (filepath.filename().string() + "." + std::to_string(getpid()) + "." +
+                         std::to_string(out) + ".tmp"))
+                     .string();
+      auto fdpath = "/proc/self/fd/" + std::to_string(out);
+      if (linkat(AT_FDCWD, fdpath.c_str(), AT_FDCWD, temppath.c_str(), AT_SYMLINK_FOLLOW) != 0)
+        throw std::runtime_error("Cannot link temporary file");
+    }
+    fs::rename(temppath, filepath);
+  } catch (...) {
+    if (data) munmap(const_cast<char *>(data), size);
+    ::close(in);
+    ::close(out);
+    std::error_code ec;
+    if (!temppath.empty()) fs::remove(temppath, ec);
+    throw;
+  }
+
+  if (data) munmap(const_cast<char *>(data), size);
+  ::close(in);
+  ::close(out);
 }
 
-namespace fs = std::filesystem;
-namespace ch = std::chrono;
+void test_remove_empty_lines_mmap() {
+  auto filepath = fs::temp_directory_path() / "remove_empty_lines.txt";
+  std::string text;
+  for (int i = 0; i < 1000; i++) {
+    text += std::string(i % 7, ' ') + (i % 3 ? "" : "line " + std::to_string(i)) + "\n";
+    if (i % 11 == 0) text += std::string(70, ' ') + "\n" + std::string(90, 'x') + "\n";
+  }
+  text += "   last line without newline";
+
+  for (const auto &input : {text, std::string(), std::string("\n \n  "), text + "\n   "}) {
+    std::ofstream(filepath, std::ios::binary | std::ios::trunc) << input;
+    remove_empty_lines(filepath);
+    std::ifstream expected_in(filepath, std::ios::binary);
+    std::string expected(std::istreambuf_iterator<char>(expected_in), {});
+
+    std::ofstream(filepath, std::ios::binary | std::ios::trunc) << input;
+    remove_empty_lines_mmap(filepath);
+    std::ifstream actual_in(filepath, std::ios::binary);
+    std::string actual(std::istreambuf_iterator<char>(actual_in), {});
+    assert(actual == expected);
+  }
+  fs::remove(filepath);
+}
 
 template <typename Duration>
 bool is_older_than(const fs::path &path, const Duration duration) {
@@ -198,6 +928,135 @@ void remove_files_older_than(const std::filesystem::path &path, const Duration d
   }
 }
 
+struct sweep_options {
+  bool dry_run = false;
+  unsigned threads = std::thread::hardware_concurrency();
+  unsigned max_unlinks_per_second = 0;  // 0 means unlimited
+};
+
+struct sweep_stats {
+  uint64_t files_scanned = 0;
+  uint64_t files_removed = 0;
+  uint64_t bytes_freed = 0;  // files with other hard links free nothing
+  uint64_t errors = 0;
+};
+
+class UnlinkRateLimiter {
+ public:
+  explicit UnlinkRateLimiter(const unsigned per_second)
+      : interval_(per_second > 0 ? ch::nanoseconds(ch::seconds(1)) / per_second
+                                 : ch::nanoseconds(0)) {}
+
+  void acquire() {
+    if (interval_.count() == 0) return;
+    ch::steady_clock::time_point slot;
+    {
+      std::lock_guard<std::mutex> lock(mt_);
+      next_ = std::max(next_, ch::steady_clock::now());
+      slot = next_;
+      next_ += interval_;
+    }
+    std::this_thread::sleep_until(slot);
+  }
+
+ private:
+  ch::nanoseconds interval_;
+  std::mutex mt_;
+  ch::steady_clock::time_point next_;
+};
+
+// Removes files (not directories) whose modification time is older than duration. Each
+// directory is listed first and its expired entries are then unlinked in one batch relative to
+// the directory descriptor.
+template <typename Duration>
+sweep_stats sweep_files_older_than(const fs::path &path, const Duration duration,
+                                   const sweep_options &options = {}) {
+  const auto cutoff = ch::system_clock::now() - duration;
+  const auto cutoff_sec = ch::duration_cast<ch::seconds>(cutoff.time_since_epoch()).count();
+  UnlinkRateLimiter limiter(options.max_unlinks_per_second);
+  std::atomic<uint64_t> scanned{0}, removed{0}, freed{0}, errors{0};
+
+  parallel_walk(
+      path,
+      [&](const std::string &dir, auto &spawn) {
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+          errors++;
+          return;
+        }
+
+        sweep_stats local;
+        std::vector<std::pair<std::string, uint64_t>> expired;
+        try {
+          read_directory(fd, [&](std::string_view name, unsigned char type, ino_t) {
+            if (type == DT_DIR) {
+              spawn(join_path(dir, name));
+              return;
+            }
+            struct stat st;
+            std::string n(name);
+            if (fstatat(fd, n.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+              local.errors++;
+              return;
+            }
+            if (S_ISDIR(st.st_mode)) {
+              spawn(join_path(dir, name));
+              return;
+            }
+            local.files_scanned++;
+            if (st.st_mtim.tv_sec < cutoff_sec)
+              expired.emplace_back(std::move(n), st.st_nlink > 1 ? 0 : st.st_size);
+          });
+        } catch (...) {
+          local.errors++;
+        }
+
+        for (const auto &[name, size] : expired) {
+          if (!options.dry_run) {
+            limiter.acquire();
+            if (unlinkat(fd, name.c_str(), 0) != 0) {
+              local.errors++;
+              continue;
+            }
+          }
+          local.files_removed++;
+          local.bytes_freed += size;
+        }
+        ::close(fd);
+
+        scanned += local.files_scanned;
+        removed += local.files_removed;
+        freed += local.bytes_freed;
+        errors += local.errors;
+      },
+      options.threads);
+
+  return {scanned, removed, freed, errors};
+}
+
+void test_sweep_files_older_than() {
+  auto root = fs::temp_directory_path() / "sweep_test";
+  fs::remove_all(root);
+  for (int d = 0; d < 10; d++) {
+    fs::create_directories(root / std::to_string(d) / "nested");
+    for (int f = 0; f < 20; f++) {
+      auto file = root / std::to_string(d) / (f % 2 ? "nested" : "") / std::to_string(f);
+      std::ofstream(file) << std::string(100, 'x');
+      if (f % 4 == 0) fs::last_write_time(file, fs::file_time_type::clock::now() - ch::hours(48));
+    }
+  }
+
+  auto dry = sweep_files_older_than(root, ch::hours(24), {.dry_run = true});
+  assert(dry.files_scanned == 200 && dry.files_removed == 50 && dry.bytes_freed == 5000);
+  auto real = sweep_files_older_than(root, ch::hours(24), {.max_unlinks_per_second = 1000});
+  assert(real.files_removed == 50 && real.errors == 0);
+  auto again = sweep_files_older_than(root, ch::hours(24));
+  assert(again.files_scanned == 150 && again.files_removed == 0);
+  std::cout << real.files_scanned << " scanned, " << real.files_removed << " removed, "
+            << real.bytes_freed << " bytes freed" << std::endl;
+  fs::remove_all(root);
+}
+
 std::vector<fs::directory_entry> find_files(const fs::path &path, const std::string &regex) {
   std::vector<fs::directory_entry> result;
   std::regex re(regex.c_str());
@@ -210,39 +1069,955 @@ std::vector<fs::directory_entry> find_files(const fs::path &path, const std::str
   return result;
 }
 
-class Logger {
+template <typename T>
+class BoundedChannel {
+ public:
+  explicit BoundedChannel(const size_t capacity) : capacity_(std::max<size_t>(1, capacity)) {}
+
+  bool push(T value) {
+    std::unique_lock<std::mutex> lock(mt_);
+    not_full_.wait(lock, [this]() { return closed_ || items_.size() < capacity_; });
+    if (closed_) return false;
+    items_.push_back(std::move(value));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  std::optional<T> pop() {
+    std::unique_lock<std::mutex> lock(mt_);
+    not_empty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+    if (items_.empty()) {
+      if (error_) std::rethrow_exception(error_);
+      return std::nullopt;
+    }
+    auto value = std::move(items_.front());
+    items_.pop_front();
+    not_full_.notify_one();
+    return value;
+  }
+
+  // For producers that want to stop before their next push rather than at it.
+  bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+  void close(std::exception_ptr error = nullptr) {
+    std::lock_guard<std::mutex> lock(mt_);
+    closed_ = true;
+    error_ = error;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
  private:
-  fs::path logpath;
-  std::ofstream logfile;
+  const size_t capacity_;
+  std::mutex mt_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<T> items_;
+  std::atomic<bool> closed_{false};  // written under mt_, read without it by closed()
+  std::exception_ptr error_;
+};
+
+class NameMatcher {
+ public:
+  enum class syntax { glob, regex };
+
+  NameMatcher(const std::string &pattern, const syntax type) : pattern_(pattern) {
+    if (type == syntax::glob) {
+      auto meta = pattern.find_first_of("*?[");
+      if (meta == std::string::npos) {
+        kind_ = kind::exact;
+      } else if (meta == pattern.size() - 1 && pattern.back() == '*') {
+        kind_ = kind::prefix;
+        pattern_.pop_back();
+      } else if (meta == 0 && pattern[0] == '*' &&
+                 pattern.find_first_of("*?[", 1) == std::string::npos) {
+        kind_ = kind::suffix;
+        pattern_.erase(0, 1);
+      } else {
+        kind_ = kind::glob;
+      }
+      return;
+    }
+
+    // regex_match anchors the whole name, so a leading run of literal characters must be a
+    // prefix of every match; the last one is dropped when a quantifier may make it optional
+    kind_ = kind::regex;
+    re_.emplace(pattern, std::regex::optimize);
+    if (pattern.find('|') != std::string::npos) {
+      // an alternative may start with anything, so there is no common literal prefix
+      pattern_.clear();
+      return;
+    }
+    auto end = pattern.find_first_of(R"(\^$.|?*+()[]{})");
+    if (end == std::string::npos) {
+      kind_ = kind::exact;
+      return;
+    }
+    pattern_ = pattern.substr(0, end);
+    if (!pattern_.empty() && std::string_view("?*{").find(pattern[end]) != std::string::npos)
+      pattern_.pop_back();
+  }
+
+  bool operator()(const std::string_view name) const {
+    switch (kind_) {
+      case kind::exact:
+        return name == pattern_;
+      case kind::prefix:
+        return name.starts_with(pattern_);
+      case kind::suffix:
+        return name.ends_with(pattern_);
+      case kind::glob:
+        return glob_match(pattern_, name);
+      case kind::regex:
+        return name.starts_with(pattern_) && std::regex_match(name.begin(), name.end(), *re_);
+    }
+    return false;
+  }
+
+ private:
+  enum class kind { exact, prefix, suffix, glob, regex };
+
+  static bool class_match(std::string_view p, size_t &i, const char c) {
+    // p[i] is '['; on return i is past the closing ']'
+    size_t j = i + 1;
+    bool negate = j < p.size() && (p[j] == '!' || p[j] == '^');
+    if (negate) j++;
+    bool matched = false;
+    for (bool first = true; j < p.size() && (first || p[j] != ']'); first = false) {
+      if (j + 2 < p.size() && p[j + 1] == '-' && p[j + 2] != ']') {
+        matched |= p[j] <= c && c <= p[j + 2];
+        j += 3;
+      } else {
+        matched |= p[j] == c;
+        j++;
+      }
+    }
+    i = j + 1;
+    return matched != negate;
+  }
+
+  static bool glob_match(std::string_view p, std::string_view s) {
+    size_t pi = 0, si = 0;
+    size_t star = std::string_view::npos, resume = 0;
+    while (si < s.size()) {
+      if (pi < p.size() && p[pi] == '*') {
+        star = ++pi;
+        resume = si;
+      } else if (pi < p.size() && p[pi] == '?') {
+        pi++;
+        si++;
+      } else if (pi < p.size() && p[pi] == '[') {
+        size_t next = pi;
+        if (class_match(p, next, s[si])) {
+          pi = next;
+          si++;
+        } else if (star != std::string_view::npos) {
+          pi = star;
+          si = ++resume;
+        } else {
+          return false;
+        }
+      } else if (pi < p.size() && p[pi] == s[si]) {
+        pi++;
+        si++;
+      } else if (star != std::string_view::npos) {
+        pi = star;
+        si = ++resume;
+      } else {
+        return false;
+      }
+    }
+    while (pi < p.size() && p[pi] == '*') pi++;
+    return pi == p.size();
+  }
 
+  std::string pattern_;
+  kind kind_;
+  std::optional<std::regex> re_;
+};
+
+struct find_options {
+  std::function<bool(std::string_view dir, std::string_view name)> exclude_dir;
+  unsigned threads = std::thread::hardware_concurrency();
+  size_t capacity = 4096;
+};
+
+// Walks path on a background thread and pushes the paths of matching regular files into the
+// returned channel as they are found; the channel is closed when the walk ends. Dropping the
+// last reference to the returned channel closes it and waits for the walk to stop, so the
+// matcher and options.exclude_dir are never called after that. Walker threads check the channel
+// before every directory and every entry, so the wait is for the entry each one has in hand and
+// a skim over the rest of its directory.
+std::shared_ptr<BoundedChannel<std::string>> find_files_async(const fs::path &path,
+                                                              NameMatcher matcher,
+                                                              find_options options = {}) {
+  auto channel = std::make_shared<BoundedChannel<std::string>>(options.capacity);
+  auto walker = std::make_shared<std::thread>([=, matcher = std::move(matcher),
+                                                options = std::move(options)]() {
+    try {
+      parallel_walk(
+          path,
+          [&](const std::string &dir, auto &spawn) {
+            if (channel->closed()) return;
+            int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+              if (dir == path.string()) throw std::runtime_error("Cannot open directory");
+              return;
+            }
+            try {
+              read_directory(fd, [&](std::string_view name, unsigned char type, ino_t) {
+                if (channel->closed()) return;
+                if (type == DT_DIR) {
+                  if (!options.exclude_dir || !options.exclude_dir(dir, name))
+                    spawn(join_path(dir, name));
+                  return;
+                }
+                if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN) return;
+                bool match = matcher(name);
+                if (type == DT_LNK && !match) return;
+                if (type != DT_REG) {
+                  // d_type alone cannot tell, only these pay for a stat
+                  struct stat st;
+                  std::string n(name);
+                  int flags = type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW;
+                  if (fstatat(fd, n.c_str(), &st, flags) != 0) return;
+                  if (type == DT_UNKNOWN && S_ISDIR(st.st_mode)) {
+                    if (!options.exclude_dir || !options.exclude_dir(dir, name))
+                      spawn(join_path(dir, name));
+                    return;
+                  }
+                  if (!S_ISREG(st.st_mode)) return;
+                }
+                if (match) channel->push(join_path(dir, name));
+              });
+            } catch (...) {
+              close(fd);
+              throw;
+            }
+            close(fd);
+          },
+          options.threads);
+      channel->close();
+    } catch (...) {
+      channel->close(std::current_exception());
+    }
+  });
+  // the walker keeps its own reference, so the consumer's copies get a deleter that closes and
+  // joins; it never runs on the walker thread
+  return std::shared_ptr<BoundedChannel<std::string>>(
+      channel.get(), [channel, walker](BoundedChannel<std::string> *) {
+        channel->close();
+        walker->join();
+      });
+}
+
+std::vector<std::string> find_files_parallel(const fs::path &path, NameMatcher matcher,
+                                             find_options options = {}) {
+  std::vector<std::string> result;
+  auto channel = find_files_async(path, std::move(matcher), std::move(options));
+  while (auto file = channel->pop()) result.push_back(std::move(*file));
+  return result;
+}
+
+void test_find_files_parallel() {
+  auto expected = find_files("/usr/include", R"(std.*\.h)").size();
+  auto found =
+      find_files_parallel("/usr/include", NameMatcher(R"(std.*\.h)", NameMatcher::syntax::regex));
+  std::cout << expected << " " << found.size() << std::endl;
+  assert(found.size() == expected);
+
+  // alternation has no literal prefix to filter on
+  auto either = find_files_parallel(
+      "/usr/include", NameMatcher(R"(std(io|lib)\.h)", NameMatcher::syntax::regex));
+  assert(either.size() == find_files("/usr/include", R"(std(io|lib)\.h)").size());
+  assert(!either.empty());
+
+  auto glob = find_files_parallel("/usr/include", NameMatcher("std*.h", NameMatcher::syntax::glob),
+                                  {.exclude_dir = [](std::string_view, std::string_view name) {
+                                     return name == "c++";
+                                   }});
+  for (const auto &f : glob) assert(f.find("/c++/") == std::string::npos);
+  std::cout << glob.size() << std::endl;
+
+  auto channel = find_files_async(".", NameMatcher("*.[ch]c", NameMatcher::syntax::glob));
+  while (auto file = channel->pop()) std::cout << *file << std::endl;
+
+  // a consumer that stops early must not leave the walker blocked on a full channel
+  auto first = find_files_async("/usr", NameMatcher("*", NameMatcher::syntax::glob),
+                                {.capacity = 1});
+  assert(first->pop());
+  first.reset();
+
+  // once the last reference is gone the walker no longer touches the caller's state
+  std::atomic<int> excluded{0};
+  auto stopped = find_files_async("/usr", NameMatcher("*", NameMatcher::syntax::glob),
+                                  {.exclude_dir = [&excluded](std::string_view, std::string_view) {
+                                     excluded++;
+                                     return false;
+                                   },
+                                   .capacity = 1});
+  assert(stopped->pop());
+  stopped.reset();
+  const int seen = excluded;
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  assert(excluded == seen);
+}
+
+// Keeps per-directory cumulative sizes and a file name index for one tree current through
+// inotify, so repeated size and find queries do not touch the disk. Files are counted per path
+// (hard links are not merged) and symlinks are not followed. On event queue overflow the whole
+// tree is scanned again.
+class DirectoryIndex {
  public:
-  Logger() {
+  explicit DirectoryIndex(const fs::path &root) : root_(fs::absolute(root).lexically_normal()) {
+    if (pipe2(stop_pipe_, O_CLOEXEC) != 0) throw std::runtime_error("Cannot create pipe");
+    try {
+      rebuild();
+    } catch (...) {
+      if (inotify_fd_ >= 0) ::close(inotify_fd_);
+      ::close(stop_pipe_[0]);
+      ::close(stop_pipe_[1]);
+      throw;
+    }
+    watcher_ = std::thread([this]() { watch(); });
+  }
+
+  DirectoryIndex(const DirectoryIndex &) = delete;
+  DirectoryIndex &operator=(const DirectoryIndex &) = delete;
+
+  ~DirectoryIndex() {
+    char c = 0;
+    [[maybe_unused]] auto n = ::write(stop_pipe_[1], &c, 1);
+    watcher_.join();
+    ::close(inotify_fd_);
+    ::close(stop_pipe_[0]);
+    ::close(stop_pipe_[1]);
+  }
+
+  std::optional<uint64_t> size(const fs::path &dir) const {
+    std::shared_lock lock(mt_);
+    auto it = ids_.find(fs::absolute(dir).lexically_normal().string());
+    if (it == ids_.end()) return std::nullopt;
+    return nodes_.at(it->second).total_bytes;
+  }
+
+  std::vector<std::string> find(const std::string &name) const {
+    std::shared_lock lock(mt_);
+    std::vector<std::string> result;
+    auto [first, last] = names_.equal_range(name);
+    for (auto it = first; it != last; ++it) {
+      result.push_back(join_path(nodes_.at(it->second).path, it->first));
+    }
+    return result;
+  }
+
+  std::vector<std::string> find_prefix(const std::string &prefix) const {
+    std::shared_lock lock(mt_);
+    std::vector<std::string> result;
+    for (auto it = names_.lower_bound(prefix);
+         it != names_.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+      result.push_back(join_path(nodes_.at(it->second).path, it->first));
+    }
+    return result;
+  }
+
+  uint64_t rescans() const { return rescans_; }
+
+ private:
+  struct dir_node {
+    std::string path;
+    int parent = -1;
+    int wd = -1;
+    uint64_t total_bytes = 0;
+    std::unordered_map<std::string, uint64_t> files;
+    std::unordered_map<std::string, int> subdirs;
+  };
+
+  static constexpr uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM |
+                                         IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+  void add_bytes(int id, const int64_t delta) {
+    for (; id >= 0; id = nodes_[id].parent) nodes_[id].total_bytes += delta;
+  }
+
+  void erase_name(const std::string &name, const int id) {
+    auto [first, last] = names_.equal_range(name);
+    for (auto it = first; it != last; ++it) {
+      if (it->second == id) {
+        names_.erase(it);
+        return;
+      }
+    }
+  }
+
+  // Adds the directory at path and everything below it; mt_ held exclusively.
+  void scan(const std::string &path, const int parent) {
+    std::vector<std::pair<std::string, int>> stack = {{path, parent}};
+    while (!stack.empty()) {
+      auto [dir, parent_id] = std::move(stack.back());
+      stack.pop_back();
+
+      int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0) continue;
+      // a moved directory keeps its watch, so the node still indexed under the old path is
+      // dropped here; it gives up the wd first so that removing it does not unwatch the move
+      int wd = inotify_add_watch(inotify_fd_, dir.c_str(), watch_mask);
+      if (auto old = wds_.find(wd); wd >= 0 && old != wds_.end()) {
+        const int old_id = old->second;
+        wds_.erase(old);
+        nodes_[old_id].wd = -1;
+        remove_dir(old_id);
+      }
+
+      const int id = next_id_++;
+      auto &node = nodes_[id];
+      node.path = dir;
+      node.parent = parent_id;
+      node.wd = wd;
+      if (wd >= 0) wds_[wd] = id;
+      ids_[dir] = id;
+      if (parent_id >= 0) nodes_[parent_id].subdirs[fs::path(dir).filename().string()] = id;
+
+      uint64_t bytes = 0;
+      try {
+        read_directory(fd, [&](std::string_view name, unsigned char type, ino_t) {
+          std::string n(name);
+          struct stat st;
+          if (type == DT_DIR) {
+            stack.emplace_back(join_path(dir, name), id);
+          } else if ((type == DT_REG || type == DT_UNKNOWN) &&
+                     fstatat(fd, n.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+              stack.emplace_back(join_path(dir, name), id);
+            } else if (S_ISREG(st.st_mode)) {
+              bytes += st.st_size;
+              names_.emplace(n, id);
+              node.files.emplace(std::move(n), st.st_size);
+            }
+          }
+        });
+      } catch (...) {
+      }
+      ::close(fd);
+      add_bytes(id, bytes);
+    }
+  }
+
+  void remove_dir(const int id) {
+    auto &node = nodes_[id];
+    for (auto [name, child] : std::vector(node.subdirs.begin(), node.subdirs.end())) {
+      remove_dir(child);
+    }
+    for (const auto &[name, size] : node.files) erase_name(name, id);
+    add_bytes(id, -static_cast<int64_t>(node.total_bytes));
+    if (node.parent >= 0) nodes_[node.parent].subdirs.erase(fs::path(node.path).filename());
+    // the wd may already belong to the same directory scanned under its new path
+    if (auto it = wds_.find(node.wd); node.wd >= 0 && it != wds_.end() && it->second == id) {
+      inotify_rm_watch(inotify_fd_, node.wd);
+      wds_.erase(it);
+    }
+    ids_.erase(node.path);
+    nodes_.erase(id);
+  }
+
+  // Brings one directory entry in line with what is on disk now. Being driven by the current
+  // state rather than by the event kind makes it safe to apply in any order and more than once.
+  void refresh(const int id, const std::string &name) {
+    auto &node = nodes_[id];
+    struct stat st;
+    bool exists = fstatat(AT_FDCWD, join_path(node.path, name).c_str(), &st,
+                          AT_SYMLINK_NOFOLLOW) == 0;
+
+    if (auto sub = node.subdirs.find(name); sub != node.subdirs.end()) {
+      if (exists && S_ISDIR(st.st_mode)) return;
+      remove_dir(sub->second);
+    }
+    if (auto file = node.files.find(name); file != node.files.end()) {
+      if (exists && S_ISREG(st.st_mode)) {
+        add_bytes(id, static_cast<int64_t>(st.st_size) - static_cast<int64_t>(file->second));
+        file->second = st.st_size;
+        return;
+      }
+      add_bytes(id, -static_cast<int64_t>(file->second));
+      node.files.erase(file);
+      erase_name(name, id);
+    }
+
+    if (!exists) return;
+    if (S_ISDIR(st.st_mode)) {
+      scan(join_path(node.path, name), id);
+    } else if (S_ISREG(st.st_mode)) {
+      node.files.emplace(name, st.st_size);
+      names_.emplace(name, id);
+      add_bytes(id, st.st_size);
+    }
+  }
+
+  void rebuild() {
+    std::unique_lock lock(mt_);
+    if (inotify_fd_ >= 0) ::close(inotify_fd_);
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ < 0) throw std::runtime_error("Cannot initialize inotify");
+    nodes_.clear();
+    ids_.clear();
+    wds_.clear();
+    names_.clear();
+    scan(root_.string(), -1);
+    if (ids_.empty()) throw std::runtime_error("Cannot open directory");
+  }
+
+  void watch() {
+    alignas(struct inotify_event) char buf[64 * 1024];
+    for (;;) {
+      pollfd fds[2] = {{stop_pipe_[0], POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+      if (poll(fds, 2, -1) < 0) continue;
+      if (fds[0].revents) return;
+
+      // drain everything that is queued, then refresh each touched entry once
+      std::set<std::pair<int, std::string>> touched;
+      bool overflow = false;
+      ssize_t n;
+      while ((n = ::read(inotify_fd_, buf, sizeof(buf))) > 0) {
+        for (ssize_t pos = 0; pos < n;) {
+          auto *e = reinterpret_cast<struct inotify_event *>(buf + pos);
+          pos += sizeof(struct inotify_event) + e->len;
+          if (e->mask & IN_Q_OVERFLOW) overflow = true;
+          if (e->len > 0) touched.emplace(e->wd, e->name);
+        }
+      }
+
+      if (overflow) {
+        rescans_++;
+        try {
+          rebuild();
+        } catch (const std::exception &e) {
+          std::cerr << e.what() << std::endl;
+        }
+        continue;
+      }
+
+      std::unique_lock lock(mt_);
+      for (const auto &[wd, name] : touched) {
+        if (auto it = wds_.find(wd); it != wds_.end()) refresh(it->second, name);
+      }
+    }
+  }
+
+  const fs::path root_;
+  int inotify_fd_ = -1;
+  int stop_pipe_[2];
+  std::atomic<uint64_t> rescans_{0};
+
+  mutable std::shared_mutex mt_;
+  int next_id_ = 0;
+  std::unordered_map<int, dir_node> nodes_;
+  std::unordered_map<std::string, int> ids_;
+  std::unordered_map<int, int> wds_;
+  std::multimap<std::string, int> names_;
+
+  std::thread watcher_;
+};
+
+void test_directory_index() {
+  auto root = fs::temp_directory_path() / "directory_index_test";
+  fs::remove_all(root);
+  fs::create_directories(root / "a" / "b");
+  std::ofstream(root / "a" / "one.log") << std::string(100, 'x');
+  std::ofstream(root / "a" / "b" / "two.log") << std::string(200, 'x');
+
+  DirectoryIndex index(root);
+  assert(index.size(root) == 300u);
+  assert(index.size(root / "a" / "b") == 200u);
+  assert(index.find("two.log").size() == 1);
+
+  auto wait_for = [&](auto condition) {
+    for (int i = 0; i < 200 && !condition(); i++) {
+      std::this_thread::sleep_for(ch::milliseconds(10));
+    }
+    return condition();
+  };
+
+  fs::create_directories(root / "c" / "d");
+  std::ofstream(root / "c" / "d" / "three.log") << std::string(50, 'x');
+  std::ofstream(root / "a" / "one.log", std::ios::app) << std::string(100, 'x');
+  assert(wait_for([&]() { return index.size(root) == 450u; }));
+  assert(index.find_prefix("t").size() == 2);
+
+  // events are applied ordered by wd: a (older) to c (newer) removes the old path before the
+  // new one is scanned, c back to the root scans the new path first; either way the moved
+  // directory must stay watched
+  fs::rename(root / "a" / "b", root / "c" / "b");
+  assert(wait_for([&]() { return index.size(root / "c") == 250u; }));
+  std::ofstream(root / "c" / "b" / "four.log") << std::string(10, 'x');
+  assert(wait_for([&]() { return index.size(root / "c" / "b") == 210u; }));
+  fs::rename(root / "c" / "b", root / "b");
+  assert(wait_for(
+      [&]() { return index.size(root / "b") == 210u && !index.size(root / "c" / "b"); }));
+  std::ofstream(root / "b" / "five.log") << std::string(20, 'x');
+  assert(wait_for([&]() { return index.size(root / "b") == 230u; }));
+  assert(index.find("five.log").size() == 1);
+  fs::remove_all(root / "a");
+  assert(wait_for([&]() { return index.size(root) == 280u && index.find("one.log").empty(); }));
+
+  std::cout << *index.size(root) << " " << parallel_directory_size(root) << std::endl;
+  fs::remove_all(root);
+}
+
+enum class fsync_policy { never, every_batch, interval };
+
+struct logger_options {
+  size_t buffer_size = 1 << 20;  // per producer thread, rounded up to a power of two
+  bool drop_when_full = false;   // otherwise producers wait for the flusher
+  std::chrono::milliseconds flush_interval{2};
+  fsync_policy sync = fsync_policy::never;
+  std::chrono::milliseconds sync_interval{1000};
+  uint64_t rotate_bytes = 0;  // 0 disables size based rotation
+  std::chrono::seconds rotate_age{0};
+};
+
+class Logger {
+ public:
+  struct stats {
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t waited;
+    uint64_t batches;
+    uint64_t rotations;
+  };
+
+  explicit Logger(logger_options options = {}) : options_(std::move(options)) {
+    size_t size = 4096;
+    while (size < options_.buffer_size) size <<= 1;
+    options_.buffer_size = size;
+
     uuid_t uuid;
     uuid_generate_random(uuid);
-    uuid_string_t name;
+    char name[37];
     uuid_unparse(uuid, name);
     logpath = fs::temp_directory_path() / (std::string(name) + ".tmp");
-    logfile.open(logpath.c_str(), std::ios::out | std::ios::trunc);
+    open_segment();
+    flusher_ = std::thread([this]() { run_flusher(); });
   }
 
+  Logger(const Logger &) = delete;
+  Logger &operator=(const Logger &) = delete;
+
   ~Logger() noexcept {
     try {
-      if (logfile.is_open()) logfile.close();
-      if (!logpath.empty()) fs::remove(logpath);
+      stop();
+      if (fd_ >= 0) ::close(fd_);
+      if (!logpath.empty()) {
+        fs::remove(logpath);
+        for (const auto &segment : segments_) fs::remove(segment);
+      }
     } catch (...) {
     }
   }
 
+  // Rotated segments become path.1, path.2, ... in the order they were written.
   void presist(const fs::path &path) {
-    logfile.close();
+    stop();
+    {
+      std::lock_guard<InstrumentedMutex<>> lock(write_mt_);
+      if (options_.sync != fsync_policy::never) fsync(fd_);
+      ::close(fd_);
+      fd_ = -1;
+    }
+    for (size_t i = 0; i < segments_.size(); i++) {
+      fs::rename(segments_[i], path.string() + "." + std::to_string(i + 1));
+    }
     fs::rename(logpath, path);
     logpath.clear();
+    segments_.clear();
   }
 
-  Logger &operator<<(const std::string &message) {
-    logfile << message.c_str() << '\n';
+  Logger &operator<<(const std::string_view message) {
+    if (stopped_.load(std::memory_order_relaxed)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return *this;
+    }
+
+    auto &buf = local_buffer();
+    const size_t need = message.size() + 1;
+    if (need > buf.data.size()) {
+      std::lock_guard<InstrumentedMutex<>> lock(write_mt_);
+      if (fd_ < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return *this;
+      }
+      drain();
+      std::array<iovec, 2> iov = {iovec{const_cast<char *>(message.data()), message.size()},
+                                  iovec{const_cast<char *>("\n"), 1}};
+      write_all(iov.data(), iov.size());
+      written_++;
+      return *this;
+    }
+
+    const size_t mask = buf.data.size() - 1;
+    const size_t head = buf.head.load(std::memory_order_relaxed);
+    bool waited = false;
+    while (buf.data.size() - (head - buf.tail.load(std::memory_order_acquire)) < need) {
+      // once stopped nobody frees space any more
+      if (options_.drop_when_full || stopped_.load(std::memory_order_relaxed)) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return *this;
+      }
+      if (!waited) waited_.fetch_add(1, std::memory_order_relaxed);
+      waited = true;
+      wake_.notify_one();
+      std::this_thread::yield();
+    }
+
+    const size_t pos = head & mask;
+    const size_t first = std::min(message.size(), buf.data.size() - pos);
+    std::memcpy(buf.data.data() + pos, message.data(), first);
+    std::memcpy(buf.data.data(), message.data() + first, message.size() - first);
+    buf.data[(head + message.size()) & mask] = '\n';
+    // seq_cst pairs the store with the stopped_ check below: either stop() sees the message
+    // or the message sees stop()
+    buf.head.store(head + need, std::memory_order_seq_cst);
+    const uint64_t messages = buf.messages.load(std::memory_order_relaxed);
+    buf.messages.store(messages + 1, std::memory_order_release);
+    if (stopped_.load(std::memory_order_seq_cst)) {
+      // raced with stop(), whose last flush may have missed the message
+      std::lock_guard<InstrumentedMutex<>> lock(write_mt_);
+      if (buf.tail.load(std::memory_order_relaxed) < head + need) {
+        if (fd_ >= 0) {
+          drain();
+        } else {
+          buf.head.store(head, std::memory_order_relaxed);
+          buf.messages.store(messages, std::memory_order_relaxed);
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      return *this;
+    }
+
+    if (head - buf.tail.load(std::memory_order_relaxed) > buf.data.size() / 2 &&
+        !buf.wake_pending.exchange(true, std::memory_order_relaxed))
+      wake_.notify_one();
     return *this;
   }
+
+  void flush() {
+    std::lock_guard<InstrumentedMutex<>> lock(write_mt_);
+    drain();
+  }
+
+  stats statistics() const {
+    return {written_.load(), dropped_.load(), waited_.load(), batches_.load(), rotations_.load()};
+  }
+
+ private:
+  // Single producer (the owning thread), single consumer (whoever holds write_mt_).
+  struct alignas(64) thread_buffer {
+    explicit thread_buffer(const size_t size) : data(size) {}
+
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+    std::atomic<bool> wake_pending{false};
+    std::atomic<bool> retired{false};  // the thread has exited, drop once drained
+    // messages published, stored after head; a message may hold newlines, so they are counted
+    // here rather than in the bytes
+    std::atomic<uint64_t> messages{0};
+    uint64_t counted = 0;  // messages added to written_, consumer side
+    std::vector<char> data;
+  };
+
+  // The logger owns the buffers; a thread only remembers the ones it writes to, and retires
+  // them when it exits.
+  struct thread_buffers {
+    ~thread_buffers() {
+      for (auto &[id, weak] : buffers) {
+        if (auto buf = weak.lock()) buf->retired.store(true, std::memory_order_release);
+      }
+    }
+
+    std::vector<std::pair<uint64_t, std::weak_ptr<thread_buffer>>> buffers;
+  };
+
+  thread_buffer &local_buffer() {
+    thread_local uint64_t cached_id = 0;
+    thread_local thread_buffer *cached = nullptr;
+    thread_local thread_buffers owned;
+    if (cached_id == id_) return *cached;
+
+    auto &list = owned.buffers;
+    auto it = std::find_if(list.begin(), list.end(), [this](auto &p) { return p.first == id_; });
+    if (it == list.end()) {
+      // buffers of loggers that are gone expire, forget them while here
+      std::erase_if(list, [](auto &p) { return p.second.expired(); });
+      auto buf = std::make_shared<thread_buffer>(options_.buffer_size);
+      {
+        std::lock_guard<InstrumentedMutex<>> lock(buffers_mt_);
+        buffers_.push_back(buf);
+      }
+      cached_id = id_;
+      cached = buf.get();
+      list.emplace_back(id_, std::move(buf));
+      return *cached;
+    }
+    // the logger keeps the buffers of threads that have not exited
+    cached_id = id_;
+    cached = it->second.lock().get();
+    return *cached;
+  }
+
+  void open_segment() {
+    fd_ = ::open(logpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) throw std::runtime_error("Cannot create log file");
+    segment_bytes_ = 0;
+    segment_start_ = ch::steady_clock::now();
+  }
+
+  void rotate() {
+    if (options_.sync != fsync_policy::never) fsync(fd_);
+    ::close(fd_);
+    auto segment = logpath.string() + "." + std::to_string(segments_.size() + 1);
+    fs::rename(logpath, segment);
+    segments_.push_back(segment);
+    rotations_++;
+    open_segment();
+  }
+
+  void write_all(iovec *iov, int count) {
+    while (count > 0) {
+      auto n = ::writev(fd_, iov, count);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        throw std::runtime_error("Cannot write log file");
+      }
+      segment_bytes_ += n;
+      for (; count > 0 && static_cast<size_t>(n) >= iov->iov_len; iov++, count--) {
+        n -= iov->iov_len;
+      }
+      if (count > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+        iov->iov_len -= n;
+      }
+    }
+  }
+
+  // Writes everything buffered so far with as few writev calls as possible; write_mt_ held.
+  void drain() {
+    constexpr size_t max_iov = 1024;
+    std::vector<std::shared_ptr<thread_buffer>> buffers;
+    {
+      std::lock_guard<InstrumentedMutex<>> lock(buffers_mt_);
+      buffers = buffers_;
+    }
+
+    std::vector<iovec> iov;
+    std::vector<std::tuple<thread_buffer *, size_t, uint64_t>> commits;
+    std::vector<thread_buffer *> retired;
+    auto count = [this](thread_buffer *buf, const uint64_t messages) {
+      written_ += messages - buf->counted;
+      buf->counted = messages;
+    };
+    auto commit = [&]() {
+      if (iov.empty()) return;
+      write_all(iov.data(), iov.size());
+      for (auto [buf, head, messages] : commits) {
+        buf->tail.store(head, std::memory_order_release);
+        count(buf, messages);
+      }
+      iov.clear();
+      commits.clear();
+      batches_++;
+    };
+
+    for (const auto &buf : buffers) {
+      buf->wake_pending.store(false, std::memory_order_relaxed);
+      if (buf->retired.load(std::memory_order_acquire)) retired.push_back(buf.get());
+      // read before head: the count never covers a message whose bytes are not taken; one
+      // taken before its count was stored is counted on a later drain
+      const uint64_t messages = buf->messages.load(std::memory_order_acquire);
+      const size_t tail = buf->tail.load(std::memory_order_relaxed);
+      const size_t head = buf->head.load(std::memory_order_acquire);
+      if (head == tail) {
+        count(buf.get(), messages);
+        continue;
+      }
+
+      if (iov.size() + 2 > max_iov) commit();
+      const size_t mask = buf->data.size() - 1;
+      const size_t pos = tail & mask;
+      const size_t first = std::min(head - tail, buf->data.size() - pos);
+      iov.push_back({buf->data.data() + pos, first});
+      if (head - tail > first) iov.push_back({buf->data.data(), head - tail - first});
+      commits.emplace_back(buf.get(), head, messages);
+    }
+    commit();
+    if (!retired.empty()) {
+      std::lock_guard<InstrumentedMutex<>> lock(buffers_mt_);
+      std::erase_if(buffers_, [&](auto &buf) {
+        return std::find(retired.begin(), retired.end(), buf.get()) != retired.end();
+      });
+    }
+
+    if (options_.sync == fsync_policy::every_batch) fdatasync(fd_);
+    if ((options_.rotate_bytes > 0 && segment_bytes_ >= options_.rotate_bytes) ||
+        (options_.rotate_age.count() > 0 && segment_bytes_ > 0 &&
+         ch::steady_clock::now() - segment_start_ >= options_.rotate_age))
+      rotate();
+  }
+
+  void run_flusher() {
+    auto last_sync = ch::steady_clock::now();
+    std::unique_lock<std::mutex> lock(wake_mt_);
+    while (!stopping_) {
+      wake_.wait_for(lock, options_.flush_interval);
+      lock.unlock();
+      try {
+        std::lock_guard<InstrumentedMutex<>> write_lock(write_mt_);
+        drain();
+        if (options_.sync == fsync_policy::interval &&
+            ch::steady_clock::now() - last_sync >= options_.sync_interval) {
+          fdatasync(fd_);
+          last_sync = ch::steady_clock::now();
+        }
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+      }
+      lock.lock();
+    }
+  }
+
+  void stop() {
+    if (stopped_.exchange(true)) return;
+    {
+      std::lock_guard<std::mutex> lock(wake_mt_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    flusher_.join();
+    flush();
+  }
+
+  static inline std::atomic<uint64_t> next_id_{1};
+
+  fs::path logpath;
+  std::vector<std::string> segments_;
+  logger_options options_;
+  const uint64_t id_ = next_id_++;
+  int fd_ = -1;
+  uint64_t segment_bytes_ = 0;
+  ch::steady_clock::time_point segment_start_;
+
+  InstrumentedMutex<> buffers_mt_{"logger_buffers"};
+  std::vector<std::shared_ptr<thread_buffer>> buffers_;
+  InstrumentedMutex<> write_mt_{"logger_write"};
+  std::mutex wake_mt_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::atomic<bool> stopped_{false};
+  std::thread flusher_;
+
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> waited_{0};
+  std::atomic<uint64_t> batches_{0};
+  std::atomic<uint64_t> rotations_{0};
 };
 
 void test_logger() {
@@ -254,6 +2029,52 @@ void test_logger() {
   } catch (...) {
     logger.presist(R"(lastlog.txt)");
   }
+  logger << "after presist";
+  assert(logger.statistics().dropped == 1);
+
+  // a message is counted once, whatever it holds
+  {
+    Logger lines;
+    lines << "first\nsecond" << "third";
+    lines.flush();
+    assert(lines.statistics().written == 2);
+  }
+
+  // short-lived threads hand their buffers back once drained
+  {
+    Logger churn({.buffer_size = 4096});
+    for (int i = 0; i < 200; i++) {
+      std::thread([&churn, i]() { churn << "short-lived thread " + std::to_string(i); }).join();
+    }
+    churn.flush();
+    assert(churn.statistics().written == 200);
+  }
+
+  const int num_thread = 16;
+  const int count = 500'000;
+  Logger bulk({.buffer_size = 4 << 20, .rotate_bytes = 64 << 20});
+  auto start = ch::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_thread; i++) {
+    threads.emplace_back([&bulk, i]() {
+      std::string message = "thread " + std::to_string(i) + " says hello, message #";
+      const auto prefix = message.size();
+      for (int j = 0; j < count; j++) {
+        message.resize(prefix);
+        message += std::to_string(j);
+        bulk << message;
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+  bulk.flush();
+  auto elapsed = ch::duration<double>(ch::steady_clock::now() - start).count();
+
+  auto s = bulk.statistics();
+  assert(s.written + s.dropped == static_cast<uint64_t>(num_thread) * count);
+  std::cout << s.written / elapsed / 1e6 << " M messages/s, " << s.batches << " batches, "
+            << s.rotations << " rotations, " << s.dropped << " dropped, " << s.waited
+            << " waits" << std::endl;
 }
 
-int main() { test_logger(); }
+int main() { test_directory_index(); }
@@ -1,15 +1,27 @@
+#include <unistd.h>
+
 #include <array>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <optional>
 #include <regex>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 template <typename Iter>
 std::string bytes_to_string(Iter begin, Iter end, bool const uppercase = false) {
   std::ostringstream oss;
@@ -64,24 +76,133 @@ void test_string_to_bytes() {
   }
 }
 
-std::string to_titlecase(std::string const& str) {
-  std::string res;
-  res.resize(str.size());
-  bool prev_is_space = true;
-  for (int i = 0; i < str.size(); i++) {
-    if (prev_is_space) {
-      res[i] = toupper(str[i]);
-      prev_is_space = false;
+enum boundary_class : unsigned {
+  boundary_space = 1u << 0,
+  boundary_punct = 1u << 1,
+  boundary_digit = 1u << 2,
+};
+
+constexpr bool is_boundary(const unsigned char c, const unsigned classes) noexcept {
+  if ((classes & boundary_space) && (c == ' ' || (c >= '\t' && c <= '\r'))) return true;
+  if ((classes & boundary_digit) && c >= '0' && c <= '9') return true;
+  if ((classes & boundary_punct) &&
+      ((c >= 0x21 && c <= 0x2F) || (c >= 0x3A && c <= 0x40) || (c >= 0x5B && c <= 0x60) ||
+       (c >= 0x7B && c <= 0x7E)))
+    return true;
+  return false;
+}
+
+size_t utf8_sequence_length(const char* s, const size_t len) noexcept {
+  auto b0 = static_cast<unsigned char>(s[0]);
+  size_t n = b0 >= 0xF0 ? 4 : b0 >= 0xE0 ? 3 : b0 >= 0xC0 ? 2 : 1;
+  if (n > len) return len;
+  for (size_t k = 1; k < n; k++) {
+    if ((static_cast<unsigned char>(s[k]) & 0xC0) != 0x80) return k;
+  }
+  return n;
+}
+
+// Only two-byte letters whose upper-case form is also two bytes long (Latin-1, Greek, Cyrillic)
+// are converted, so the string never changes length.
+size_t utf8_toupper_inplace(char* s, const size_t len) noexcept {
+  auto n = utf8_sequence_length(s, len);
+  if (n != 2 || (static_cast<unsigned char>(s[0]) & 0xE0) != 0xC0) return n;
+
+  unsigned cp = ((static_cast<unsigned char>(s[0]) & 0x1F) << 6) |
+                (static_cast<unsigned char>(s[1]) & 0x3F);
+  if ((cp >= 0xE0 && cp <= 0xFE && cp != 0xF7) || (cp >= 0x3B1 && cp <= 0x3CB && cp != 0x3C2) ||
+      (cp >= 0x430 && cp <= 0x44F))
+    cp -= 0x20;
+  else if (cp >= 0x450 && cp <= 0x45F)
+    cp -= 0x50;
+  s[0] = static_cast<char>(0xC0 | (cp >> 6));
+  s[1] = static_cast<char>(0x80 | (cp & 0x3F));
+  return n;
+}
+
+#if defined(__SSE2__)
+inline __m128i in_range(const __m128i v, const char lo, const char hi) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+inline __m128i boundary_mask(const __m128i v, const unsigned classes) {
+  auto mask = _mm_setzero_si128();
+  if (classes & boundary_space)
+    mask = _mm_or_si128(mask, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                           in_range(v, '\t', '\r')));
+  if (classes & boundary_digit) mask = _mm_or_si128(mask, in_range(v, '0', '9'));
+  if (classes & boundary_punct)
+    mask = _mm_or_si128(
+        mask, _mm_or_si128(_mm_or_si128(in_range(v, 0x21, 0x2F), in_range(v, 0x3A, 0x40)),
+                           _mm_or_si128(in_range(v, 0x5B, 0x60), in_range(v, 0x7B, 0x7E))));
+  return mask;
+}
+#endif
+
+void to_titlecase(std::span<char> str, const unsigned classes = boundary_space) {
+  char* s = str.data();
+  const size_t n = str.size();
+  bool prev_is_boundary = true;
+  size_t i = 0;
+
+  while (i < n) {
+#if defined(__SSE2__)
+    if (i + 16 <= n) {
+      auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+      if (_mm_movemask_epi8(v) == 0) {
+        // a letter is upper-cased when the byte before it is a boundary: shift the boundary
+        // vector up by one lane and carry in the state of the previous block
+        auto bound = boundary_mask(v, classes);
+        auto prev = _mm_slli_si128(bound, 1);
+        if (prev_is_boundary) prev = _mm_or_si128(prev, _mm_cvtsi32_si128(0xFF));
+        auto delta =
+            _mm_and_si128(_mm_and_si128(prev, in_range(v, 'a', 'z')), _mm_set1_epi8(0x20));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(s + i), _mm_sub_epi8(v, delta));
+        prev_is_boundary = (_mm_movemask_epi8(bound) & 0x8000) != 0;
+        i += 16;
+        continue;
+      }
+    }
+#endif
+    auto c = static_cast<unsigned char>(s[i]);
+    if (c < 0x80) {
+      if (prev_is_boundary && c >= 'a' && c <= 'z') s[i] = static_cast<char>(c - 0x20);
+      prev_is_boundary = is_boundary(c, classes);
+      i++;
     } else {
-      if ((res[i] = str[i]) == ' ') prev_is_space = true;
+      i += prev_is_boundary ? utf8_toupper_inplace(s + i, n - i)
+                            : utf8_sequence_length(s + i, n - i);
+      prev_is_boundary = false;
     }
   }
+}
+
+void to_titlecase(std::span<std::string> strs, const unsigned classes = boundary_space) {
+  for (auto& s : strs) to_titlecase(std::span<char>(s), classes);
+}
+
+std::string to_titlecase(std::string const& str) {
+  std::string res = str;
+  to_titlecase(std::span<char>(res));
   return res;
 }
 
 void test_titlecase() {
   auto s = "the c++ challenger";
   std::cout << to_titlecase(s) << std::endl;
+
+  std::string long_name = "x-ray scanner, model 3b\tzero-latency édition über grün";
+  to_titlecase(std::span<char>(long_name), boundary_space | boundary_punct);
+  assert(long_name == "X-Ray Scanner, Model 3b\tZero-Latency Édition Über Grün");
+
+  std::vector<std::string> names = {"red apple", "гром и молния", "",
+                                    "aaaaaaaaaaaaaaa bbbbbbbbbbbbbbbbbbbbbbbbbbbbb c"};
+  to_titlecase(std::span<std::string>(names));
+  assert(names[0] == "Red Apple");
+  assert(names[1] == "Гром И Молния");
+  assert(names[2].empty());
+  assert(names[3] == "Aaaaaaaaaaaaaaa Bbbbbbbbbbbbbbbbbbbbbbbbbbbbb C");
 }
 
 std::string concat(const std::vector<std::string>& strs, const std::string delimiter) {
@@ -244,14 +365,131 @@ void test_parse_uri() {
   assert(p2->fragment == "ui");
 }
 
+class DateFormatRewriter {
+ public:
+  using sink_type = std::function<void(std::string_view)>;
+
+  explicit DateFormatRewriter(sink_type sink, const size_t block_size = 1 << 20)
+      : sink_(std::move(sink)), in_(block_size + pattern_size), out_(block_size) {}
+
+  void rewrite(std::istream& in) {
+    run([&in](char* buf, size_t size) -> size_t {
+      in.read(buf, size);
+      if (in.bad()) throw std::runtime_error("Cannot read input stream");
+      return in.gcount();
+    });
+  }
+
+  void rewrite(const int fd) {
+    run([fd](char* buf, size_t size) -> size_t {
+      ssize_t n;
+      while ((n = ::read(fd, buf, size)) < 0 && errno == EINTR) {
+      }
+      if (n < 0) throw std::runtime_error("Cannot read input file");
+      return n;
+    });
+  }
+
+ private:
+  static constexpr size_t pattern_size = 10;
+
+  static bool is_digit(const char c) noexcept { return c >= '0' && c <= '9'; }
+  static bool is_separator(const char c) noexcept { return c == '.' || c == '-'; }
+
+  // dd.mm.yyyy or dd-mm-yyyy (separators may be mixed), and a real calendar date
+  static bool match_date(const char* p) noexcept {
+    if (!is_separator(p[2]) || !is_separator(p[5])) return false;
+    for (int k : {0, 1, 3, 4, 6, 7, 8, 9}) {
+      if (!is_digit(p[k])) return false;
+    }
+    auto d = (p[0] - '0') * 10 + (p[1] - '0');
+    auto m = (p[3] - '0') * 10 + (p[4] - '0');
+    auto y = (p[6] - '0') * 1000 + (p[7] - '0') * 100 + (p[8] - '0') * 10 + (p[9] - '0');
+    return std::chrono::year_month_day{std::chrono::year{y}, std::chrono::month(m),
+                                       std::chrono::day(d)}
+        .ok();
+  }
+
+  template <typename Read>
+  void run(Read&& read) {
+    size_t carry = 0;
+    bool eof = false;
+    while (!eof) {
+      auto n = read(in_.data() + carry, in_.size() - carry);
+      eof = n == 0;
+      n += carry;
+
+      // without more input a match can only start where a whole pattern still fits
+      const char* s = in_.data();
+      const size_t stop = eof ? n : n - std::min(n, pattern_size - 1);
+      size_t plain = 0, i = 0;
+      while (i < stop) {
+        if (i + pattern_size <= n && match_date(s + i)) {
+          emit(s + plain, i - plain);
+          const char iso[pattern_size] = {s[i + 6], s[i + 7], s[i + 8], s[i + 9], '-',
+                                          s[i + 3], s[i + 4], '-',      s[i],     s[i + 1]};
+          emit(iso, pattern_size);
+          i += pattern_size;
+          plain = i;
+        } else {
+          i++;
+        }
+      }
+      emit(s + plain, i - plain);
+      carry = n - i;
+      std::memmove(in_.data(), s + i, carry);
+    }
+    if (used_ > 0) sink_(std::string_view(out_.data(), used_));
+    used_ = 0;
+  }
+
+  void emit(const char* data, size_t size) {
+    while (size > 0) {
+      if (used_ == 0 && size >= out_.size()) {
+        sink_(std::string_view(data, size));
+        return;
+      }
+      auto n = std::min(size, out_.size() - used_);
+      std::memcpy(out_.data() + used_, data, n);
+      used_ += n;
+      data += n;
+      size -= n;
+      if (used_ == out_.size()) {
+        sink_(std::string_view(out_.data(), used_));
+        used_ = 0;
+      }
+    }
+  }
+
+  sink_type sink_;
+  std::vector<char> in_;
+  std::vector<char> out_;
+  size_t used_ = 0;
+};
+
 std::string convert_date_format(const std::string& input) {
-  std::regex re(R"(([0-9]{2})(\.|-)([0-9]{2})(\.|-)([0-9]{4}))");
-  return std::regex_replace(input.c_str(), re, "$5-$3-$1");
+  std::string res;
+  std::istringstream in(input);
+  DateFormatRewriter rewriter([&res](std::string_view s) { res.append(s); });
+  rewriter.rewrite(in);
+  return res;
 }
 
 void test_convert_date_format() {
   using namespace std::string_literals;
   std::cout << convert_date_format("today is 01.12.2017!"s) << std::endl;
+  assert(convert_date_format("01.12.2017 and 31-12.1999") == "2017-12-01 and 1999-12-31");
+  assert(convert_date_format("not a date: 31.02.2017") == "not a date: 31.02.2017");
+  assert(convert_date_format("29-02-2024 29-02-2023") == "2024-02-29 29-02-2023");
+
+  // dates that straddle the edges of tiny chunks are still found
+  std::string text;
+  for (int i = 0; i < 100; i++) text += "row " + std::to_string(i) + ";15.06.2020;x\n";
+  std::string out;
+  std::istringstream in(text);
+  DateFormatRewriter rewriter([&out](std::string_view s) { out.append(s); }, 7);
+  rewriter.rewrite(in);
+  assert(out == std::regex_replace(text, std::regex(R"(15\.06\.2020)"), "2020-06-15"));
 }
 
 int main() { test_convert_date_format(); }
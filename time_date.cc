@@ -1,20 +1,39 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <utility>
+#include <vector>
 
-template <typename Time = std::chrono::microseconds,
-          typename Clock = std::chrono::high_resolution_clock>
-struct perf_timer {
-  template <typename F, typename... Args>
-  static Time duration(F&& f, Args... args) {
-    auto start = Clock::now();
-    std::invoke(std::forward<F>(f), std::forward<Args>(args)...);
-    auto end = Clock::now();
-    return std::chrono::duration_cast<Time>(end - start);
-  }
-};
+#include "benchmark.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 void f() {
   using namespace std::chrono_literals;
@@ -44,22 +63,9 @@ void test_number_of_days() {
 }
 
 unsigned week_day(std::chrono::sys_days date) {
-  std::chrono::year_month_weekday date_weekday{date};
-
-  auto weekday2int = [](std::chrono::weekday wd) {
-    if (wd == std::chrono::Sunday) return 1;
-    if (wd == std::chrono::Monday) return 2;
-    if (wd == std::chrono::Tuesday) return 3;
-    if (wd == std::chrono::Wednesday) return 4;
-    if (wd == std::chrono::Thursday) return 5;
-    if (wd == std::chrono::Friday) return 6;
-    if (wd == std::chrono::Saturday) return 7;
-    throw std::runtime_error("Not reachable!");
-  };
-  return weekday2int(date_weekday.weekday());
+  return std::chrono::weekday{date}.c_encoding() + 1;
 }
 
-
 void test_week_day() {
   using namespace std::chrono_literals;
   auto date = 2022y/6/30;
@@ -67,13 +73,959 @@ void test_week_day() {
 }
 
 int day_of_year(const std::chrono::year_month_day& date) {
-  auto first_date = std::chrono::year_month_day{
-    std::chrono::year{date.year()}, std::chrono::month{1}, std::chrono::day{0}};
-  return (std::chrono::sys_days{ date } - std::chrono::sys_days{ first_date }).count();
+  auto first_date = date.year() / std::chrono::January / 1;
+  return (std::chrono::sys_days{date} - std::chrono::sys_days{first_date}).count() + 1;
+}
+
+struct civil_fields {
+  int32_t year;
+  uint8_t month;
+  uint8_t day;
+  uint8_t weekday;  // ISO 8601: Monday = 1 ... Sunday = 7
+  uint16_t day_of_year;
+  int32_t iso_year;
+  uint8_t iso_week;
+};
+
+// Hinnant's days-to-civil algorithm, shifted by a whole number of 400-year eras so that all
+// arithmetic is unsigned. Conditionals are written as arithmetic so that column loops
+// vectorize. Valid over the whole range of std::chrono::year.
+constexpr civil_fields civil_from_days(const int32_t days) noexcept {
+  constexpr uint32_t eras = 100;  // 1970 - 40000 is below year::min()
+  constexpr uint32_t shift = eras * 146097;
+
+  const uint32_t z = static_cast<uint32_t>(days + 719468) + shift;
+  const uint32_t era = z / 146097;
+  const uint32_t doe = z - era * 146097;
+  const uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const uint32_t mp = (5 * doy + 2) / 153;
+  const uint32_t d = doy - (153 * mp + 2) / 5 + 1;
+  const uint32_t m = mp + 3 - 12 * (mp >= 10);
+  const uint32_t uy = yoe + era * 400 + (m <= 2);  // year + eras * 400
+
+  auto is_leap = [](const uint32_t y) { return (y % 4 == 0) & ((y % 100 != 0) | (y % 400 == 0)); };
+  const uint32_t leap = is_leap(uy);
+  const uint32_t yday = doy + 60 + leap - (m <= 2) * (365 + leap);
+  const uint32_t wd = (static_cast<uint32_t>(days) + shift + 3) % 7 + 1;
+
+  // ISO week: weeks start on Monday and week 1 holds the year's first Thursday, so a year has
+  // 53 weeks when it starts on a Thursday, or on a Wednesday in a leap year
+  const uint32_t jan1 = (wd + 371 - yday) % 7;  // Monday = 0
+  const uint32_t week = (yday - wd + 10) / 7;
+  const uint32_t weeks_prev = 52 + ((jan1 == 4) | (is_leap(uy - 1) & (jan1 == 5)));
+  const uint32_t weeks_this = 52 + ((jan1 == 3) | (leap & (jan1 == 2)));
+  const uint32_t before = week == 0;  // last week of the previous ISO year
+  const uint32_t after = week > weeks_this;  // first week of the next ISO year
+  const uint32_t iso_week = week + before * weeks_prev - after * (week - 1);
+  const int32_t iso_shift = static_cast<int32_t>(after) - static_cast<int32_t>(before);
+
+  const int32_t year = static_cast<int32_t>(uy) - static_cast<int32_t>(eras * 400);
+  return {year,
+          static_cast<uint8_t>(m),
+          static_cast<uint8_t>(d),
+          static_cast<uint8_t>(wd),
+          static_cast<uint16_t>(yday),
+          year + iso_shift,
+          static_cast<uint8_t>(iso_week)};
+}
+
+constexpr int32_t days_from_epoch_seconds(const int64_t seconds) noexcept {
+  return static_cast<int32_t>(seconds / 86400 - (seconds % 86400 < 0));
 }
 
 unsigned int calendar_week(const std::chrono::year_month_day& date) {
-  return day_of_year(date) / 7;
+  return civil_from_days(std::chrono::sys_days{date}.time_since_epoch().count()).iso_week;
+}
+
+// Column-wise conversions; any output span may be empty when that column is not needed.
+struct civil_columns {
+  std::span<int32_t> year;
+  std::span<uint8_t> month;
+  std::span<uint8_t> day;
+  std::span<uint8_t> weekday;
+  std::span<uint16_t> day_of_year;
+  std::span<uint8_t> iso_week;
+};
+
+template <typename ToDays, typename In>
+void civil_from_column(std::span<const In> in, const civil_columns& out, ToDays to_days) {
+  const size_t n = in.size();
+  const In* src = in.data();
+  auto store = [n, src, &to_days](auto column, auto field) {
+    if (column.empty()) return;
+    if (column.size() < n) throw std::invalid_argument("Output column is too short");
+    // raw pointers: a uint8_t store through the span could alias the span itself
+    auto* dst = column.data();
+    for (size_t i = 0; i < n; i++) dst[i] = civil_from_days(to_days(src[i])).*field;
+  };
+
+  // one pass per column keeps every loop free of stores it does not need
+  store(out.year, &civil_fields::year);
+  store(out.month, &civil_fields::month);
+  store(out.day, &civil_fields::day);
+  store(out.weekday, &civil_fields::weekday);
+  store(out.day_of_year, &civil_fields::day_of_year);
+  store(out.iso_week, &civil_fields::iso_week);
+}
+
+// days since 1970-01-01, the layout of Arrow/Parquet date32 columns
+void civil_from_days(std::span<const int32_t> days, const civil_columns& out) {
+  civil_from_column(days, out, [](const int32_t d) { return d; });
+}
+
+void civil_from_days(std::span<const std::chrono::sys_days> days, const civil_columns& out) {
+  civil_from_column(days, out, [](std::chrono::sys_days d) {
+    return static_cast<int32_t>(d.time_since_epoch().count());
+  });
+}
+
+void civil_from_seconds(std::span<const int64_t> seconds, const civil_columns& out) {
+  civil_from_column(seconds, out, days_from_epoch_seconds);
+}
+
+void test_civil_from_days() {
+  using namespace std::chrono;
+  static_assert(civil_from_days(0).year == 1970 && civil_from_days(0).weekday == 4);
+  static_assert(civil_from_days(-1).day_of_year == 365 && civil_from_days(-1).iso_week == 1);
+
+  // every day representable by std::chrono::year
+  const int32_t first = sys_days{year::min() / January / 1}.time_since_epoch().count();
+  const int32_t last = sys_days{year::max() / December / 31}.time_since_epoch().count();
+  for (int32_t n = first; n <= last; n++) {
+    const sys_days d{days{n}};
+    const year_month_day ymd{d};
+    const auto c = civil_from_days(n);
+    assert(c.year == static_cast<int>(ymd.year()));
+    assert(c.month == static_cast<unsigned>(ymd.month()));
+    assert(c.day == static_cast<unsigned>(ymd.day()));
+    assert(c.weekday == weekday{d}.iso_encoding());
+    assert(c.day_of_year == day_of_year(ymd));
+
+    // the ISO year starts on the Monday of the week that holds January 4th
+    auto week_start = [](const year y) {
+      const sys_days jan4 = y / January / 4;
+      return jan4 - (weekday{jan4} - Monday);
+    };
+    if (n == first || n == last || c.iso_week == 1 || c.iso_week >= 52) {
+      auto y = year{c.iso_year};
+      assert(week_start(y) <= d && (y == year::max() || d < week_start(y + years{1})));
+      assert(c.iso_week == (d - week_start(y)).count() / 7 + 1);
+    }
+  }
+
+  std::vector<int64_t> seconds = {0, -1, 86399, 86400, 1656547200, -2208988800};
+  std::vector<int32_t> years(seconds.size());
+  std::vector<uint16_t> yday(seconds.size());
+  civil_from_seconds(seconds, {.year = years, .day_of_year = yday});
+  assert((years == std::vector<int32_t>{1970, 1969, 1970, 1970, 2022, 1900}));
+  assert((yday == std::vector<uint16_t>{1, 365, 1, 2, 181, 1}));
+
+  std::vector<int32_t> column(10'000'000);
+  std::iota(column.begin(), column.end(), -5'000'000);
+  std::vector<uint8_t> weeks(column.size());
+  std::cout << benchmark("iso_week of 10M days", [&]() {
+    civil_from_days(std::span<const int32_t>(column), {.iso_week = weeks});
+    do_not_optimize(weeks.data());
+  }, {.samples = 5}) << std::endl;
+}
+
+// UTC offsets of one IANA zone as a flat transition table, read once from its TZif file. The
+// POSIX rule in the file's footer is expanded up to 2100 so that slim TZif files (which stop
+// listing transitions once a rule takes over) give the same answers as fat ones.
+class TimeZone {
+ public:
+  static const TimeZone& locate(const std::string& name) {
+    static std::mutex mt;
+    static std::map<std::string, std::unique_ptr<TimeZone>, std::less<>> zones;
+    std::lock_guard<std::mutex> lock(mt);
+    auto it = zones.find(name);
+    if (it == zones.end())
+      it = zones.emplace(name, std::unique_ptr<TimeZone>(new TimeZone(name))).first;
+    return *it->second;
+  }
+
+  const std::string& name() const noexcept { return name_; }
+
+  // Offset from UTC in seconds at the UTC instant t (seconds since the epoch).
+  int32_t offset_at(const int64_t t) const noexcept {
+    // consecutive lookups in a column mostly land in the same interval
+    size_t i = last_hit_.load(std::memory_order_relaxed);
+    if (!(starts_[i] <= t && (i + 1 == starts_.size() || t < starts_[i + 1]))) {
+      i = std::upper_bound(starts_.begin(), starts_.end(), t) - starts_.begin() - 1;
+      last_hit_.store(i, std::memory_order_relaxed);
+    }
+    return offsets_[i];
+  }
+
+  // UTC instant of a local wall-clock time. Times in a gap are shifted forward by its length
+  // and ambiguous times resolve to the earlier instant.
+  int64_t to_utc(const int64_t local) const noexcept {
+    // the answer lies in the interval holding the guess or in one next to it
+    const int64_t guess = local - offset_at(local);
+    const size_t i = std::upper_bound(starts_.begin(), starts_.end(), guess) - starts_.begin() - 1;
+    const size_t first = i > 0 ? i - 1 : 0;
+    const size_t last = std::min(i + 1, starts_.size() - 1);
+    for (size_t k = first; k <= last; k++) {
+      const int64_t t = local - offsets_[k];
+      if (t >= starts_[k] && (k + 1 == starts_.size() || t < starts_[k + 1])) return t;
+    }
+    // in a gap: read with the offset from before the jump, the smaller one
+    for (size_t k = first + 1; k <= last; k++) {
+      if (local - offsets_[k] < starts_[k]) return local - offsets_[k - 1];
+    }
+    return local - offsets_[i];
+  }
+
+ private:
+  explicit TimeZone(const std::string& name) : name_(name) {
+    const int fd = ::open(("/usr/share/zoneinfo/" + name).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("Unknown time zone: " + name);
+    std::string data;
+    char buf[16 * 1024];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+      if (n > 0) data.append(buf, n);
+    }
+    ::close(fd);
+    if (n < 0) throw std::runtime_error("Cannot read time zone: " + name);
+    parse_tzif(data);
+  }
+
+  static int64_t read_be(const char* p, const int size) {
+    uint64_t v = 0;
+    for (int k = 0; k < size; k++) v = (v << 8) | static_cast<unsigned char>(p[k]);
+    return size == 4 ? static_cast<int32_t>(v) : static_cast<int64_t>(v);
+  }
+
+  void parse_tzif(const std::string& data) {
+    auto header = [&data](const size_t pos, std::array<int64_t, 6>& counts) {
+      if (data.size() < pos + 44 || data.compare(pos, 4, "TZif") != 0)
+        throw std::runtime_error("Invalid TZif data");
+      for (int k = 0; k < 6; k++) {
+        counts[k] = read_be(data.data() + pos + 20 + 4 * k, 4);
+        if (counts[k] < 0) throw std::runtime_error("Invalid TZif data");
+      }
+    };
+
+    // isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt
+    std::array<int64_t, 6> c;
+    header(0, c);
+    size_t pos = 44;
+    int time_size = 4;
+    if (data[4] >= '2') {
+      pos += c[3] * 5 + c[4] * 6 + c[5] + c[2] * 8 + c[1] + c[0];
+      header(pos, c);
+      pos += 44;
+      time_size = 8;
+    }
+    if (data.size() < pos + c[3] * (time_size + 1) + c[4] * 6)
+      throw std::runtime_error("Invalid TZif data");
+
+    const char* times = data.data() + pos;
+    const char* indexes = times + c[3] * time_size;
+    const char* types = indexes + c[3];
+    auto type_offset = [types](const int i) {
+      return static_cast<int32_t>(read_be(types + 6 * i, 4));
+    };
+
+    starts_.push_back(std::numeric_limits<int64_t>::min());
+    offsets_.push_back(c[4] > 0 ? type_offset(0) : 0);
+    for (int64_t i = 0; i < c[3]; i++) {
+      const auto type = static_cast<unsigned char>(indexes[i]);
+      if (type >= c[4]) throw std::runtime_error("Invalid TZif data");
+      starts_.push_back(read_be(times + i * time_size, time_size));
+      offsets_.push_back(type_offset(type));
+    }
+
+    pos += c[3] * (time_size + 1) + c[4] * 6 + c[5] + c[2] * (time_size + 4) + c[1] + c[0];
+    if (time_size == 8 && pos < data.size() && data[pos] == '\n') {
+      auto end = data.find('\n', pos + 1);
+      if (end != std::string::npos) expand_rule(data.substr(pos + 1, end - pos - 1));
+    }
+  }
+
+  // Handles the common "STD offset DST [offset],Mm.w.d[/time],Mm.w.d[/time]" form.
+  void expand_rule(const std::string& rule) {
+    const char* p = rule.c_str();
+    // ASCII only, the zone data does not depend on the locale
+    auto alpha = [](const char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); };
+    auto digit = [](const char c) { return c >= '0' && c <= '9'; };
+    auto skip_name = [&p, &alpha]() {
+      if (*p == '<') {
+        while (*p && *p++ != '>') {
+        }
+      } else {
+        while (alpha(*p)) p++;
+      }
+    };
+    auto parse_hms = [&p, &digit]() {
+      int sign = 1;
+      if (*p == '+' || *p == '-') sign = *p++ == '-' ? -1 : 1;
+      int64_t value = 0;
+      for (int unit = 3600; unit >= 1 && digit(*p); unit /= 60) {
+        int v = 0;
+        while (digit(*p)) v = v * 10 + (*p++ - '0');
+        value += v * unit;
+        if (*p != ':') break;
+        p++;
+      }
+      return sign * value;
+    };
+
+    skip_name();
+    const int32_t std_offset = -parse_hms();
+    if (*p == '\0') return;
+    skip_name();
+    int32_t dst_offset = std_offset + 3600;
+    if (*p != ',') dst_offset = -parse_hms();
+
+    auto parse_date = [&p, &parse_hms](int& month, int& week, int& day, int64_t& time) {
+      if (*p++ != ',' || *p++ != 'M') return false;
+      month = std::strtol(p, const_cast<char**>(&p), 10);
+      if (*p++ != '.') return false;
+      week = std::strtol(p, const_cast<char**>(&p), 10);
+      if (*p++ != '.') return false;
+      day = std::strtol(p, const_cast<char**>(&p), 10);
+      time = 7200;
+      if (*p == '/') {
+        p++;
+        time = parse_hms();
+      }
+      return true;
+    };
+    int m1, w1, d1, m2, w2, d2;
+    int64_t t1, t2;
+    if (!parse_date(m1, w1, d1, t1) || !parse_date(m2, w2, d2, t2)) return;
+
+    using namespace std::chrono;
+    auto local_day = [](const int y, const int m, const int w, const int d) {
+      auto wd = weekday{static_cast<unsigned>(d)};
+      auto mon = month{static_cast<unsigned>(m)};
+      sys_days day = w == 5 ? sys_days{year{y} / mon / wd[last]} : sys_days{year{y} / mon / wd[w]};
+      return static_cast<int64_t>(day.time_since_epoch().count()) * 86400;
+    };
+
+    const int first_year = civil_from_days(days_from_epoch_seconds(starts_.back())).year;
+    for (int y = std::max(first_year, 1970); y <= 2100; y++) {
+      std::array<std::pair<int64_t, int32_t>, 2> changes = {
+          std::pair{local_day(y, m1, w1, d1) + t1 - std_offset, dst_offset},
+          std::pair{local_day(y, m2, w2, d2) + t2 - dst_offset, std_offset}};
+      std::sort(changes.begin(), changes.end());
+      for (auto [at, offset] : changes) {
+        if (at > starts_.back()) {
+          starts_.push_back(at);
+          offsets_.push_back(offset);
+        }
+      }
+    }
+  }
+
+  std::string name_;
+  std::vector<int64_t> starts_;
+  std::vector<int32_t> offsets_;
+  mutable std::atomic<size_t> last_hit_{0};
+};
+
+// Sixteen bytes "YYYY-MM-DDTHH:MM" to fields; false unless every digit is a digit and every
+// separator is in place ('T', 't' or ' ' between date and time).
+inline bool parse_date_time_prefix(const char* s, int& y, int& mo, int& d, int& h, int& mi) {
+#if defined(__SSE2__)
+  const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+  const auto digits = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  // bytes that are separators are compared against the template instead
+  const auto is_sep = _mm_setr_epi8(0, 0, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0, -1, 0, 0);
+  const auto tmpl = _mm_setr_epi8(0, 0, 0, 0, '-', 0, 0, '-', 0, 0, 'T', 0, 0, ':', 0, 0);
+  const auto ok_digit = _mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(9)), digits);
+  const auto t = _mm_or_si128(v, _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                                _mm_set1_epi8('T' ^ ' ')));
+  // fold case only at the 'T' position
+  const auto fold = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x20, 0, 0, 0, 0, 0);
+  const auto ok_sep = _mm_cmpeq_epi8(_mm_andnot_si128(fold, t), tmpl);
+  const auto ok = _mm_or_si128(_mm_andnot_si128(is_sep, ok_digit), _mm_and_si128(is_sep, ok_sep));
+  if (_mm_movemask_epi8(ok) != 0xFFFF) return false;
+
+  // widen to 16 bits and let pmaddwd form the two-digit groups
+  const auto zero = _mm_setzero_si128();
+  const auto sums_lo = _mm_madd_epi16(_mm_unpacklo_epi8(digits, zero),
+                                      _mm_setr_epi16(1000, 100, 10, 1, 0, 10, 1, 0));
+  const auto sums_hi = _mm_madd_epi16(_mm_unpackhi_epi8(digits, zero),
+                                      _mm_setr_epi16(10, 1, 0, 10, 1, 0, 10, 1));
+  alignas(16) int32_t lo[4], hi[4];
+  _mm_store_si128(reinterpret_cast<__m128i*>(lo), sums_lo);
+  _mm_store_si128(reinterpret_cast<__m128i*>(hi), sums_hi);
+  y = lo[0] + lo[1];
+  mo = lo[2] + lo[3];
+  d = hi[0];
+  h = hi[1] + hi[2];
+  mi = hi[3];
+  return true;
+#else
+  auto digit = [](const char c) { return static_cast<unsigned>(c - '0') <= 9; };
+  for (int k : {0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15}) {
+    if (!digit(s[k])) return false;
+  }
+  if (s[4] != '-' || s[7] != '-' || s[13] != ':' || (s[10] != 'T' && s[10] != 't' && s[10] != ' '))
+    return false;
+  auto two = [s](const int k) { return (s[k] - '0') * 10 + (s[k + 1] - '0'); };
+  y = two(0) * 100 + two(2);
+  mo = two(5);
+  d = two(8);
+  h = two(11);
+  mi = two(14);
+  return true;
+#endif
+}
+
+using timestamp = std::chrono::sys_time<std::chrono::nanoseconds>;
+
+// ISO-8601 / RFC-3339 "YYYY-MM-DD[T ]HH:MM:SS[.fraction][Z|+HH:MM|+HHMM|+HH]". A timestamp
+// without an offset is wall-clock time in zone, or UTC when no zone is given.
+std::optional<timestamp> parse_timestamp(std::string_view s, const TimeZone* zone = nullptr) {
+  // the prefix is loaded as 16 bytes straight from the input, which has at least 19
+  if (s.size() < 19) return std::nullopt;
+  const char* p = s.data();
+
+  int y, mo, d, h, mi;
+  if (!parse_date_time_prefix(p, y, mo, d, h, mi)) return std::nullopt;
+  auto digit = [](const char c) { return static_cast<unsigned>(c - '0') <= 9; };
+  if (p[16] != ':' || !digit(p[17]) || !digit(p[18])) return std::nullopt;
+  const int sec = (p[17] - '0') * 10 + (p[18] - '0');
+  if (h > 23 || mi > 59 || sec > 60) return std::nullopt;
+
+  const std::chrono::year_month_day ymd{std::chrono::year{y},
+                                        std::chrono::month{static_cast<unsigned>(mo)},
+                                        std::chrono::day{static_cast<unsigned>(d)}};
+  if (!ymd.ok()) return std::nullopt;
+
+  size_t i = 19;
+  int64_t nanos = 0;
+  if (i < s.size() && (s[i] == '.' || s[i] == ',')) {
+    size_t start = ++i;
+    // digits past the ninth are ignored; the rest are scaled once at the end
+    constexpr int64_t scale[10] = {1'000'000'000, 100'000'000, 10'000'000, 1'000'000, 100'000,
+                                   10'000,        1'000,       100,        10,        1};
+    for (; i < s.size() && digit(s[i]); i++) {
+      if (i - start < 9) nanos = nanos * 10 + (s[i] - '0');
+    }
+    if (i == start) return std::nullopt;
+    nanos *= scale[std::min<size_t>(i - start, 9)];
+  }
+
+  int64_t seconds =
+      static_cast<int64_t>(std::chrono::sys_days{ymd}.time_since_epoch().count()) * 86400 +
+      h * 3600 + mi * 60 + sec;
+  if (i == s.size()) {
+    if (zone) seconds = zone->to_utc(seconds);
+  } else if ((s[i] == 'Z' || s[i] == 'z') && i + 1 == s.size()) {
+  } else if (s[i] == '+' || s[i] == '-') {
+    auto z = s.substr(i + 1);
+    auto two = [&digit](std::string_view v) {
+      return digit(v[0]) && digit(v[1]) ? (v[0] - '0') * 10 + (v[1] - '0') : -1;
+    };
+    int oh = -1, om = 0;
+    if (z.size() == 2) {
+      oh = two(z);
+    } else if (z.size() == 4) {
+      oh = two(z);
+      om = two(z.substr(2));
+    } else if (z.size() == 5 && z[2] == ':') {
+      oh = two(z);
+      om = two(z.substr(3));
+    }
+    if (oh < 0 || om < 0 || oh > 23 || om > 59) return std::nullopt;
+    seconds -= (s[i] == '-' ? -1 : 1) * (oh * 3600 + om * 60);
+  } else {
+    return std::nullopt;
+  }
+  return timestamp{std::chrono::nanoseconds{seconds * 1'000'000'000 + nanos}};
+}
+
+// Parses every string of a column; entries that fail become timestamp::min(). Returns the
+// number of failures. Long columns are split into contiguous ranges parsed by up to num_thread
+// threads; they share the zone, which is only read (its lookup cache is atomic).
+size_t parse_timestamps(std::span<const std::string_view> in, std::span<timestamp> out,
+                        const TimeZone* zone = nullptr,
+                        const unsigned num_thread = std::thread::hardware_concurrency()) {
+  if (out.size() < in.size()) throw std::invalid_argument("Output column is too short");
+  auto parse = [&](const size_t begin, const size_t end) {
+    size_t failures = 0;
+    for (size_t i = begin; i < end; i++) {
+      auto t = parse_timestamp(in[i], zone);
+      failures += !t;
+      out[i] = t.value_or(timestamp::min());
+    }
+    return failures;
+  };
+
+  constexpr size_t chunk = 1 << 16;  // below this a thread costs more than it saves
+  const size_t parts = std::clamp<size_t>(in.size() / chunk, 1, std::max(1u, num_thread));
+  if (parts == 1) return parse(0, in.size());
+
+  std::vector<size_t> failures(parts);
+  std::vector<std::thread> threads;
+  for (size_t p = 1; p < parts; p++) {
+    threads.emplace_back([&, p]() {
+      failures[p] = parse(in.size() * p / parts, in.size() * (p + 1) / parts);
+    });
+  }
+  failures[0] = parse(0, in.size() / parts);
+  for (auto& t : threads) t.join();
+  return std::accumulate(failures.begin(), failures.end(), size_t{0});
+}
+
+// Writes "YYYY-MM-DDTHH:MM:SS[.f...]Z", or "+HH:MM" in place of "Z" when a zone is given, to
+// out (at least 36 bytes). Returns the length, or 0 for years outside 0..9999.
+size_t format_timestamp(const timestamp t, char* out, const TimeZone* zone = nullptr,
+                        const int fraction_digits = 0) {
+  const int64_t ns = t.time_since_epoch().count();
+  int64_t seconds = ns / 1'000'000'000 - (ns % 1'000'000'000 < 0);
+  int64_t nanos = ns - seconds * 1'000'000'000;
+  const int32_t offset = zone ? zone->offset_at(seconds) : 0;
+  seconds += offset;
+
+  const int32_t days = days_from_epoch_seconds(seconds);
+  const auto c = civil_from_days(days);
+  if (c.year < 0 || c.year > 9999) return 0;
+  int64_t sod = seconds - static_cast<int64_t>(days) * 86400;
+
+  auto put2 = [](char* p, const unsigned v) {
+    p[0] = static_cast<char>('0' + v / 10);
+    p[1] = static_cast<char>('0' + v % 10);
+  };
+  put2(out, c.year / 100);
+  put2(out + 2, c.year % 100);
+  out[4] = '-';
+  put2(out + 5, c.month);
+  out[7] = '-';
+  put2(out + 8, c.day);
+  out[10] = 'T';
+  put2(out + 11, sod / 3600);
+  out[13] = ':';
+  put2(out + 14, sod / 60 % 60);
+  out[16] = ':';
+  put2(out + 17, sod % 60);
+
+  size_t n = 19;
+  if (fraction_digits > 0) {
+    out[n++] = '.';
+    int64_t scale = 100'000'000;
+    for (int k = 0; k < std::min(fraction_digits, 9); k++, scale /= 10) {
+      out[n++] = static_cast<char>('0' + nanos / scale % 10);
+    }
+  }
+  if (!zone) {
+    out[n++] = 'Z';
+  } else {
+    const int32_t a = offset < 0 ? -offset : offset;
+    out[n++] = offset < 0 ? '-' : '+';
+    put2(out + n, a / 3600);
+    out[n + 2] = ':';
+    put2(out + n + 3, a / 60 % 60);
+    n += 5;
+  }
+  return n;
+}
+
+void test_timestamps() {
+  using namespace std::chrono;
+  auto utc = [](const sys_days d, const int h, const int m, const int s) {
+    return timestamp{d + hours{h} + minutes{m} + seconds{s}};
+  };
+
+  assert(parse_timestamp("2022-06-30T12:34:56Z") == utc(2022y / 6 / 30, 12, 34, 56));
+  assert(parse_timestamp("2022-06-30t12:34:56.5+02:00") ==
+         utc(2022y / 6 / 30, 10, 34, 56) + milliseconds{500});
+  assert(parse_timestamp("2022-06-30 12:34:56,123456789-0530") ==
+         utc(2022y / 6 / 30, 18, 4, 56) + nanoseconds{123456789});
+  assert(parse_timestamp("1969-12-31T23:59:59Z") == utc(1970y / 1 / 1, 0, 0, -1));
+  assert(!parse_timestamp("2022-02-30T00:00:00Z"));
+  assert(!parse_timestamp("2022-06-30T24:00:00Z"));
+  assert(!parse_timestamp("2022-06-30T12:34"));
+  assert(!parse_timestamp("2022/06/30T12:34:56Z"));
+  assert(!parse_timestamp("2022-06-30T12:34:56+2"));
+
+  const auto& berlin = TimeZone::locate("Europe/Berlin");
+  const auto& new_york = TimeZone::locate("America/New_York");
+  assert(parse_timestamp("2022-06-30T12:00:00", &berlin) == utc(2022y / 6 / 30, 10, 0, 0));
+  assert(parse_timestamp("2022-01-15T12:00:00", &berlin) == utc(2022y / 1 / 15, 11, 0, 0));
+  assert(parse_timestamp("2022-01-15T12:00:00", &new_york) == utc(2022y / 1 / 15, 17, 0, 0));
+  assert(parse_timestamp("2090-07-04T12:00:00", &new_york) == utc(2090y / 7 / 4, 16, 0, 0));
+  // 02:30 does not exist on the spring-forward day and reads as 03:30 CEST; on the fall-back day
+  // it exists twice and reads as the first, still CEST
+  assert(parse_timestamp("2022-03-27T02:30:00", &berlin) == utc(2022y / 3 / 27, 1, 30, 0));
+  assert(parse_timestamp("2022-03-27T03:30:00", &berlin) == utc(2022y / 3 / 27, 1, 30, 0));
+  assert(parse_timestamp("2022-10-30T02:30:00", &berlin) == utc(2022y / 10 / 30, 0, 30, 0));
+  assert(parse_timestamp("2022-10-30T03:30:00", &berlin) == utc(2022y / 10 / 30, 2, 30, 0));
+  assert(parse_timestamp("2022-03-13T02:30:00", &new_york) == utc(2022y / 3 / 13, 7, 30, 0));
+  assert(parse_timestamp("2022-11-06T01:30:00", &new_york) == utc(2022y / 11 / 6, 5, 30, 0));
+
+  char buf[40];
+  auto t = *parse_timestamp("2022-06-30T12:34:56.789Z");
+  assert(std::string_view(buf, format_timestamp(t, buf)) == "2022-06-30T12:34:56Z");
+  assert(std::string_view(buf, format_timestamp(t, buf, &berlin, 3)) ==
+         "2022-06-30T14:34:56.789+02:00");
+  assert(std::string_view(buf, format_timestamp(t, buf, &new_york)) ==
+         "2022-06-30T08:34:56-04:00");
+
+  // one buffer for the whole column rather than a string per row
+  const size_t rows = 10'000'000;
+  std::string text(rows * 36, '\0');  // format_timestamp writes at most 36 bytes
+  std::vector<std::string_view> views(rows);
+  for (size_t i = 0, used = 0; i < rows; i++) {
+    const auto at = utc(2022y / 1 / 1, 0, 0, 0) + seconds{i * 3};
+    const size_t n = format_timestamp(at, text.data() + used, &berlin, 3);
+    views[i] = std::string_view(text.data() + used, n);
+    used += n;
+  }
+  std::vector<timestamp> parsed(views.size());
+  std::cout << benchmark("parse 10M timestamps", [&]() {
+    do_not_optimize(parse_timestamps(views, parsed, &berlin));
+  }, {.samples = 3}) << std::endl;
+  assert(parsed[12345] == utc(2022y / 1 / 1, 0, 0, 12345 * 3));
+  // split across threads the result is the same, failures included
+  views[rows - 1] = "not a timestamp";
+  std::vector<timestamp> split(views.size());
+  assert(parse_timestamps(views, split, &berlin, 4) == 1);
+  assert(parse_timestamps(views, parsed, &berlin, 1) == 1);
+  assert(split == parsed && split[rows - 1] == timestamp::min());
+}
+
+// Log-linear histogram in the manner of HdrHistogram: exact below 64, then 32 linear steps per
+// power of two (relative error under 1.6%), saturating at 2^40. Histograms merge by adding counts.
+class LogHistogram {
+ public:
+  static constexpr int sub_bits = 5;
+  static constexpr int max_bits = 40;
+  static constexpr size_t size = (max_bits - sub_bits + 1) << sub_bits;
+
+  static constexpr size_t index_of(uint64_t v) noexcept {
+    v = std::min<uint64_t>(v, (uint64_t{1} << max_bits) - 1);
+    const int shift = std::max(static_cast<int>(std::bit_width(v)), sub_bits + 1) - (sub_bits + 1);
+    return (static_cast<size_t>(shift) << sub_bits) + (v >> shift);
+  }
+
+  // Smallest value and width of the range counted at index.
+  static constexpr std::pair<uint64_t, uint64_t> range_of(const size_t index) noexcept {
+    const int shift = std::max(static_cast<int>(index >> sub_bits) - 1, 0);
+    return {(index - (static_cast<size_t>(shift) << sub_bits)) << shift, uint64_t{1} << shift};
+  }
+
+  void add(const uint64_t v, const uint64_t n = 1) noexcept { add_at(index_of(v), n); }
+  void add_at(const size_t index, const uint64_t n) noexcept {
+    counts_[index] += n;
+    total_ += n;
+  }
+
+  void merge(const LogHistogram& other) noexcept {
+    for (size_t i = 0; i < size; i++) counts_[i] += other.counts_[i];
+    total_ += other.total_;
+  }
+
+  uint64_t total() const noexcept { return total_; }
+
+  // Midpoint of the range holding the value of rank ceil(q * total).
+  uint64_t quantile(const double q) const noexcept {
+    if (total_ == 0) return 0;
+    const auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * total_)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < size; i++) {
+      seen += counts_[i];
+      if (seen >= rank) {
+        auto [lo, width] = range_of(i);
+        return lo + (width - 1) / 2;
+      }
+    }
+    return range_of(size - 1).first;
+  }
+
+ private:
+  std::array<uint64_t, size> counts_{};
+  uint64_t total_ = 0;
+};
+
+struct window_stats {
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t min = std::numeric_limits<uint64_t>::max();
+  uint64_t max = 0;
+  LogHistogram histogram;
+
+  double mean() const noexcept { return count ? static_cast<double>(sum) / count : 0.0; }
+  uint64_t quantile(const double q) const noexcept {
+    return count ? std::clamp(histogram.quantile(q), min, max) : 0;
+  }
+};
+
+// Count, sum, extrema and a LogHistogram of the values recorded in each time bucket of a fixed
+// width, kept in a ring of bucket_count slots. The ring advances lazily: a slot is cleared when
+// the first event of a newer bucket lands in it, and an event whose slot already holds a newer
+// bucket is dropped and counted in late().
+//
+// Every recording thread owns a shard, so record() does plain loads and stores without atomic
+// read-modify-writes or shared cache lines; queries merge the shards. A reader may see a bucket
+// in the middle of an update (count bumped, histogram not yet), but never a half-cleared one.
+// A thread's first record() allocates or adopts a shard; shards of exited threads keep their
+// data and are handed to the next new thread.
+template <typename Clock = std::chrono::system_clock>
+class RollingAggregator {
+ public:
+  using time_point = typename Clock::time_point;
+  using duration = typename Clock::duration;
+
+  RollingAggregator(const duration width, const size_t bucket_count)
+      : width_(width.count()), bucket_count_(bucket_count), id_(next_id()) {
+    if (width_ <= 0 || bucket_count == 0) throw std::invalid_argument("Invalid bucket layout");
+  }
+  RollingAggregator(const RollingAggregator&) = delete;
+  RollingAggregator& operator=(const RollingAggregator&) = delete;
+
+  void record(const time_point t, const uint64_t value) {
+    Shard& shard = local_shard();
+    const int64_t ticks = t.time_since_epoch().count();
+    Slot* slot = shard.current;
+    if (!slot || ticks < shard.begin || ticks >= shard.end) {
+      slot = advance(shard, ticks);
+      if (!slot) {
+        bump(shard.late, uint64_t{1});
+        return;
+      }
+    }
+    bump(slot->count, uint64_t{1});
+    bump(slot->sum, value);
+    if (value < slot->min.load(std::memory_order_relaxed))
+      slot->min.store(value, std::memory_order_relaxed);
+    if (value > slot->max.load(std::memory_order_relaxed))
+      slot->max.store(value, std::memory_order_relaxed);
+    bump(slot->histogram[LogHistogram::index_of(value)], uint64_t{1});
+  }
+
+  // The bucket holding t.
+  window_stats tumbling(const time_point t) const {
+    const auto epoch = epoch_of(t.time_since_epoch().count());
+    return collect(epoch, epoch);
+  }
+
+  // The buckets covering window up to and including the one holding now, rounded up to whole
+  // buckets and capped at the ring size.
+  window_stats sliding(const time_point now, const duration window) const {
+    const auto last = epoch_of(now.time_since_epoch().count());
+    const int64_t n = std::clamp<int64_t>((window.count() + width_ - 1) / width_, 1,
+                                          static_cast<int64_t>(bucket_count_));
+    return collect(last - n + 1, last);
+  }
+
+  // Shards allocated so far, at most the number of threads that recorded at the same time.
+  size_t shards() const {
+    std::lock_guard<std::mutex> lock(owned_mt_);
+    return owned_.size();
+  }
+
+  uint64_t late() const noexcept {
+    uint64_t n = 0;
+    for (auto s = shards_.load(std::memory_order_acquire); s; s = s->next)
+      n += s->late.load(std::memory_order_relaxed);
+    return n;
+  }
+
+ private:
+  static constexpr int64_t empty = std::numeric_limits<int64_t>::min();
+  static constexpr int64_t clearing = empty + 1;
+
+  struct Slot {
+    std::atomic<int64_t> epoch{empty};
+    std::atomic<uint64_t> count{0}, sum{0};
+    std::atomic<uint64_t> min{std::numeric_limits<uint64_t>::max()}, max{0};
+    std::array<std::atomic<uint64_t>, LogHistogram::size> histogram{};
+  };
+
+  struct alignas(64) Shard {
+    explicit Shard(const size_t n) : slots(new Slot[n]) {}
+    std::unique_ptr<Slot[]> slots;
+    Slot* current = nullptr;  // slot of [begin, end), the bucket written last
+    int64_t begin = 0, end = 0;
+    std::atomic<uint64_t> late{0};
+    std::atomic<bool> in_use{true};
+    Shard* next = nullptr;
+  };
+
+  static uint64_t next_id() {
+    static std::atomic<uint64_t> id{1};
+    return id.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  template <typename T>
+  static void bump(std::atomic<T>& a, const T v) noexcept {
+    a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+  int64_t epoch_of(const int64_t ticks) const noexcept {
+    return ticks / width_ - (ticks % width_ < 0);
+  }
+
+  struct entry {
+    uint64_t id;
+    Shard* shard;
+    std::weak_ptr<Shard> owner;
+  };
+
+  // The shards a thread writes to, given back when it exits. The weak references keep a shard
+  // alive while it is released, and expire with aggregators that are gone.
+  struct thread_shards {
+    ~thread_shards() {
+      for (auto& e : entries) {
+        if (auto shard = e.owner.lock()) shard->in_use.store(false, std::memory_order_release);
+      }
+    }
+    std::vector<entry> entries;
+  };
+
+  Shard& local_shard() {
+    // ids are never reused, so entries of destroyed aggregators simply stop matching
+    thread_local std::pair<uint64_t, Shard*> last{0, nullptr};
+    if (last.first == id_) return *last.second;
+    thread_local thread_shards known;
+    auto& entries = known.entries;
+    auto it = std::find_if(entries.begin(), entries.end(), [this](auto& e) { return e.id == id_; });
+    if (it == entries.end()) {
+      std::erase_if(entries, [](auto& e) { return e.owner.expired(); });
+      it = entries.insert(entries.end(), adopt_shard());
+    }
+    last = {id_, it->shard};
+    return *last.second;
+  }
+
+  // A shard released by an exited thread, or a new one.
+  entry adopt_shard() {
+    std::lock_guard<std::mutex> lock(owned_mt_);
+    for (auto& shard : owned_) {
+      bool free = false;
+      if (shard->in_use.compare_exchange_strong(free, true, std::memory_order_acquire))
+        return {id_, shard.get(), shard};
+    }
+    auto& shard = owned_.emplace_back(std::make_shared<Shard>(bucket_count_));
+    shard->next = shards_.load(std::memory_order_relaxed);
+    shards_.store(shard.get(), std::memory_order_release);
+    return {id_, shard.get(), shard};
+  }
+
+  Slot* advance(Shard& shard, const int64_t ticks) noexcept {
+    const int64_t epoch = epoch_of(ticks);
+    const auto n = static_cast<int64_t>(bucket_count_);
+    Slot& slot = shard.slots[static_cast<size_t>((epoch % n + n) % n)];
+    const int64_t held = slot.epoch.load(std::memory_order_relaxed);
+    if (held > epoch) return nullptr;
+    if (held != epoch) {
+      // same protocol as a seqlock: readers that overlap the clear see the epoch change
+      slot.epoch.store(clearing, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      slot.count.store(0, std::memory_order_relaxed);
+      slot.sum.store(0, std::memory_order_relaxed);
+      slot.min.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+      slot.max.store(0, std::memory_order_relaxed);
+      for (auto& c : slot.histogram) c.store(0, std::memory_order_relaxed);
+      slot.epoch.store(epoch, std::memory_order_release);
+    }
+    shard.current = &slot;
+    shard.begin = epoch * width_;
+    shard.end = shard.begin + width_;
+    return &slot;
+  }
+
+  window_stats collect(const int64_t first, const int64_t last) const {
+    window_stats out;
+    LogHistogram h;
+    for (auto s = shards_.load(std::memory_order_acquire); s; s = s->next) {
+      for (size_t i = 0; i < bucket_count_; i++) {
+        const Slot& slot = s->slots[i];
+        const int64_t epoch = slot.epoch.load(std::memory_order_acquire);
+        if (epoch < first || epoch > last) continue;
+        h = LogHistogram{};
+        for (size_t k = 0; k < LogHistogram::size; k++) {
+          if (auto c = slot.histogram[k].load(std::memory_order_relaxed)) h.add_at(k, c);
+        }
+        const auto count = slot.count.load(std::memory_order_relaxed);
+        const auto sum = slot.sum.load(std::memory_order_relaxed);
+        const auto min = slot.min.load(std::memory_order_relaxed);
+        const auto max = slot.max.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.epoch.load(std::memory_order_relaxed) != epoch) continue;  // cleared meanwhile
+        out.count += count;
+        out.sum += sum;
+        out.min = std::min(out.min, min);
+        out.max = std::max(out.max, max);
+        out.histogram.merge(h);
+      }
+    }
+    return out;
+  }
+
+  const int64_t width_;
+  const size_t bucket_count_;
+  const uint64_t id_;
+  std::atomic<Shard*> shards_{nullptr};  // newest first, for readers
+  mutable std::mutex owned_mt_;
+  std::vector<std::shared_ptr<Shard>> owned_;
+};
+
+void test_rolling_aggregator() {
+  using namespace std::chrono;
+  const system_clock::time_point t0 = sys_days{2022y / 6 / 30} + 12h;
+
+  RollingAggregator<system_clock> per_minute(1min, 60);
+  std::vector<std::thread> threads;
+  for (int k = 0; k < 4; k++) {
+    threads.emplace_back([&per_minute, t0]() {
+      for (int i = 0; i < 120'000; i++) per_minute.record(t0 + seconds{i % 600}, 1 + i % 1000);
+    });
+  }
+  for (auto& t : threads) t.join();
+
+  auto ten = per_minute.sliding(t0 + 9min, 10min);
+  assert(ten.count == 4 * 120'000);
+  assert(ten.sum == 4 * (120 * 499'500 + 120'000));
+  assert(ten.min == 1 && ten.max == 1000);
+  assert(std::abs(static_cast<double>(ten.quantile(0.5)) - 500) < 500 * 0.02);
+  assert(std::abs(static_cast<double>(ten.quantile(0.99)) - 990) < 990 * 0.02);
+  assert(per_minute.tumbling(t0 + 30s).count == 4 * 12'000);
+  assert(per_minute.sliding(t0 + 4min, 2min).count == 4 * 2 * 12'000);
+
+  // threads that come later take over the shards of those that exited, data included
+  const size_t shards = per_minute.shards();
+  assert(shards >= 1 && shards <= 4);
+  for (int k = 0; k < 8; k++) std::thread([&per_minute, t0]() { per_minute.record(t0, 1); }).join();
+  assert(per_minute.shards() == shards);
+  assert(per_minute.tumbling(t0 + 30s).count == 4 * 12'000 + 8);
+
+  // two hours later the ring has wrapped: the slot of t0 now belongs to t0 + 2h
+  per_minute.record(t0 + 2h, 7);
+  per_minute.record(t0, 7);
+  assert(per_minute.late() == 1);
+  auto hour = per_minute.sliding(t0 + 2h, 1h);
+  assert(hour.count == 1 && hour.quantile(0.5) == 7);
+  assert(per_minute.shards() == shards);
+
+  RollingAggregator<system_clock> per_second(1s, 60);
+  std::cout << benchmark("rolling aggregator record", [&](const uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) per_second.record(t0 + nanoseconds{i * 1000}, i & 4095);
+  }) << std::endl;
+}
+
+void test_benchmark() {
+  std::vector<int> data(4096);
+  std::iota(data.begin(), data.end(), 0);
+
+  std::cout << benchmark("accumulate 4096 ints", [&data]() {
+    do_not_optimize(std::accumulate(data.begin(), data.end(), 0L));
+  }) << std::endl;
+  std::cout << benchmark(
+                   "week_day x1000",
+                   [](const uint64_t n) {
+                     auto date = std::chrono::sys_days{std::chrono::year{2022} / 6 / 30};
+                     for (uint64_t i = 0; i < n * 1000; i++) do_not_optimize(week_day(date));
+                   },
+                   {.counters = true})
+            << std::endl;
 }
 
-int main() { test_week_day(); }
+int main() { test_rolling_aggregator(); }